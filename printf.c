@@ -11,8 +11,15 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 typedef enum state {
     INITIAL,
@@ -84,6 +91,61 @@ struct printSpecification {
     specifier s;
 };
 
+typedef enum ARG_TYPE {
+    ARG_NONE,
+    ARG_INT,
+    ARG_UNSIGNED,
+    ARG_LONG,
+    ARG_UNSIGNED_LONG,
+    ARG_DOUBLE,
+    ARG_STRING
+} argType;
+
+//A single argument, as read from the argument list.
+union printArgument {
+    long i;
+    unsigned long u;
+    double d;
+    char *s;
+};
+
+//Where a conversion's value, width and precision come from.
+//value is the 1-based position of a POSIX "%n$" argument, or 0 for the next sequential argument.
+//width/precision are ARG_SOURCE_NONE when not read from the arguments at all, 0 for '*' and n for '*n$'.
+#define ARG_SOURCE_NONE -1
+typedef struct argSources {
+    int value;
+    int width;
+    int precision;
+} argSources;
+
+//nextToken hit a positional conversion, which can't be printed straight off the va_list.
+#define TOKEN_POSITIONAL 1
+
+#define MAX_FORMAT_SEGMENTS 32
+#define MAX_COMPILED_ARGS 64
+
+//A literal run of the format string, followed by an optional conversion (spec is 0 if there isn't one).
+//valueArg/widthArg/precisionArg are indices into the argument block, or -1 if unused.
+struct formatSegment {
+    unsigned int literalStart;
+    unsigned int literalLength;
+    struct printSpecification ps;
+    char spec;
+    int valueArg;
+    int widthArg;
+    int precisionArg;
+};
+
+//A format string parsed once up front, so that repeated prints skip parsing and read every argument in O(1).
+struct compiledFormat {
+    const char *fmt;
+    unsigned int numSegments;
+    struct formatSegment segments[MAX_FORMAT_SEGMENTS];
+    unsigned int numArgs;
+    argType argTypes[MAX_COMPILED_ARGS];
+};
+
 
 //%[flags][width][.precision][vectorSize][length]specifier
 
@@ -181,8 +243,10 @@ static int padString(
     if (ps->f.leftJustify) {
         //        printf("left justifying\n");
         //Just add trailing paddedSize-existingSize trailing spaces
-        for (paddingWritten = 0; paddingWritten < paddingAmount;) {
-            paddingWritten += printChar(output, ' ', outPos, outSize);
+        for (paddingWritten = 0; paddingWritten < paddingAmount; paddingWritten++) {
+            if (!printChar(output, ' ', outPos, outSize)) {
+                break;
+            }
         }
         if (paddingAmount != paddingWritten) {
             //The CL spec lets us get away with undefined behavior when the buffer overflows.
@@ -195,8 +259,10 @@ static int padString(
         char paddingChar = ps->f.leftPadWithZeroes && ps->s != SPEC_S ? '0' : ' ';
         //Pad the string to the desired width
         unsigned int startingPos = *outPos;
-        for (unsigned int i = 0; i < paddingAmount; i++) {
-            paddingWritten += printChar(output, paddingChar, outPos, outSize);
+        for (paddingWritten = 0; paddingWritten < paddingAmount; paddingWritten++) {
+            if (!printChar(output, paddingChar, outPos, outSize)) {
+                break;
+            }
         }
         if (paddingAmount != paddingWritten) {
             //The CL spec lets us get away with undefined behavior when the buffer overflows.
@@ -205,9 +271,12 @@ static int padString(
             return -1;
         }
         //Shift the value over by paddedSize-existingSize characters, starting with the right end.
-        //Make sure to skip any existing prefix characters.
+        //Zeroes go between the sign and the digits, but spaces go ahead of the sign.
         //        printf("starting position: %u\n", startingPos);
         //        printf("buffer before right justifying sub-string: ^%s^\n", output);
+        if (paddingChar == ' ') {
+            existingSize += existingPrefixChars;
+        }
         stringStart = startingPos - existingSize;
         for (i = existingSize; i >= 0; i--) {
             int from = stringStart + i;
@@ -425,6 +494,9 @@ static int printHex(struct printSpecification *ps, char *output, unsigned int *o
     return padString(output, outPos, outSize, (*outPos) - startPos, 0, ps);
 }
 
+//Fraction digits printFloat takes from the value. 10^15 still scales a fraction to an exact integer.
+#define FLOAT_FRACTION_DIGITS 15
+
 static int printFloat(struct printSpecification *ps, char *output, unsigned int *outPos, size_t outSize, double value)
 {
     if (isnan(value)){
@@ -457,23 +529,27 @@ static int printFloat(struct printSpecification *ps, char *output, unsigned int
     double intValue;
     double fracValue = fabs(modf(value, &intValue));
 
-    int signChars = printSign(ps, output, outPos, outSize, intValue >= 0.0);
+    int signChars = printSign(ps, output, outPos, outSize, !signbit(value));
     if (signChars < 0) return -1;
     unsigned int startPos = *outPos;
 
     unsigned printed = 0;
-    if (fracValue != 0.0 || ps->f.zeroPrefixedOrForceDecimal){
-        //Scale the value to be an integer of the number of digits needed for our precision and round it.
-        fracValue = roundf(fracValue * pow(10.0, precision));
-        int isSpecG = (ps->s == SPEC_LOWER_G || ps->s == SPEC_UPPER_G) && !ps->f.zeroPrefixedOrForceDecimal ;
-        for (int i = 0; i < precision; i++){
-            double curFracValue = trunc((fracValue / pow(10.0, i)));
-            double digit = roundf(modf(curFracValue/10.0, &curFracValue) * 10.0);
+    int isSpecG = (ps->s == SPEC_LOWER_G || ps->s == SPEC_UPPER_G) && !ps->f.zeroPrefixedOrForceDecimal ;
+    //Integral values still get zeroes after the decimal point, except for the 'G' specs which trim them.
+    if (fracValue != 0.0 || !isSpecG){
+        //Scale the value to be an integer of the number of digits needed for our precision and round it. A double
+        //has nothing left to give past FLOAT_FRACTION_DIGITS, so any further digits are zeroes.
+        int scaledDigits = precision < FLOAT_FRACTION_DIGITS ? precision : FLOAT_FRACTION_DIGITS;
+        fracValue = round(fracValue * pow(10.0, scaledDigits));
+        for (int i = precision; i > 0; i--){
+            //Peel off one digit at a time rather than dividing by pow(10.0, i) for each one.
+            int digit = i > scaledDigits ? 0 : (int) round(modf(fracValue/10.0, &fracValue) * 10.0);
 
 			//The 'G' specs don't want trailing zeroes on the decimal portion.
-            if ((int)digit == 0 && printed == 0 && isSpecG) continue;
+            if (digit == 0 && printed == 0 && isSpecG) continue;
 
-            if (printDigit(output, outPos, outSize, (int) digit, 0) < 0) return -1;
+            //The digits come out backwards, so there's nothing worth keeping once the buffer is full.
+            if (!printChar(output, '0' + digit, outPos, outSize)) return -1;
             printed++;
         }
     }
@@ -492,21 +568,22 @@ static int printFloat(struct printSpecification *ps, char *output, unsigned int
     return padString(output, outPos, outSize, (*outPos) - startPos, signChars, ps);
 }
 
-static int printLong(struct printSpecification *ps, char *output, unsigned int *outPos, size_t outSize, long value) {
+long wrapSignedValueToSize(struct printSpecification *ps, long value) {
     switch (ps->length) {
         case hh:
-            value = (long) ((char) value);
-            break;
+            return (long) ((char) value);
         case h:
-            value = (long) ((short) value);
-            break;
+            return (long) ((short) value);
         case l:
-            break;
+            return value;
         case hl:
         default:
-            value = (int) value;
-            break;
+            return (int) value;
     }
+}
+
+static int printLong(struct printSpecification *ps, char *output, unsigned int *outPos, size_t outSize, long value) {
+    value = wrapSignedValueToSize(ps, value);
 
     if (value == 0 && ps->precision == 0){
         return 0;
@@ -584,7 +661,102 @@ static int printShortestFloat(struct printSpecification *ps, char *output, unsig
     return printScientific(ps, output, outPos, outSize, value);
 }
 
-int printSpec(struct printSpecification *ps, char* output, unsigned int* outPos, size_t out_size, char spec, va_list args){
+//Returns the type of argument the given specifier/length combination reads from the argument list.
+static argType specArgType(char spec, length len) {
+    switch (spec) {
+        case 'g': case 'G': case 'f': case 'F': case 'e': case 'E':
+            return ARG_DOUBLE;
+        case 's':
+            return ARG_STRING;
+        case 'c':
+            return ARG_INT;
+        case 'd': case 'i':
+            return len == l ? ARG_LONG : ARG_INT;
+        case 'o': case 'u': case 'x': case 'X':
+            return len == l ? ARG_UNSIGNED_LONG : ARG_UNSIGNED;
+        default:
+            return ARG_NONE;
+    }
+}
+
+//Reads a single argument of the given type. Returns 0 if the type can't be read.
+static int readArgument(argType type, union printArgument *arg, va_list args) {
+    switch (type) {
+        case ARG_INT:
+            arg->i = va_arg(args, int);
+            return 1;
+        case ARG_UNSIGNED:
+            arg->u = va_arg(args, unsigned int);
+            return 1;
+        case ARG_LONG:
+            arg->i = va_arg(args, long);
+            return 1;
+        case ARG_UNSIGNED_LONG:
+            arg->u = va_arg(args, unsigned long);
+            return 1;
+        case ARG_DOUBLE:
+            arg->d = va_arg(args, double);
+            return 1;
+        case ARG_STRING:
+            arg->s = va_arg(args, char*);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//Optional caps on widths, precisions and the buffer a single call may use, for callers that would rather see
+//clamped output than let a format like %999999999d fill a large buffer. Zero means no cap, which is the default:
+//the emitters already stop once the buffer is full and the rest is only measured. Each clamp is counted in
+//clamped.
+struct printLimits {
+    atomic_int maxWidth;
+    atomic_int maxPrecision;
+    atomic_uint maxOutput;
+    atomic_ulong clamped;
+};
+
+static struct printLimits printLimits;
+
+static void setPrintLimits(int maxWidth, int maxPrecision, unsigned int maxOutput) {
+    atomic_store_explicit(&printLimits.maxWidth, maxWidth, memory_order_relaxed);
+    atomic_store_explicit(&printLimits.maxPrecision, maxPrecision, memory_order_relaxed);
+    atomic_store_explicit(&printLimits.maxOutput, maxOutput, memory_order_relaxed);
+}
+
+//How many widths, precisions and outputs have been cut down to the limits so far.
+static unsigned long printLimitClamps() {
+    return atomic_load_explicit(&printLimits.clamped, memory_order_relaxed);
+}
+
+static void limitSpecification(struct printSpecification *ps) {
+    int maxWidth = atomic_load_explicit(&printLimits.maxWidth, memory_order_relaxed);
+    int maxPrecision = atomic_load_explicit(&printLimits.maxPrecision, memory_order_relaxed);
+
+    if (maxWidth > 0 && ps->width > maxWidth) {
+        ps->width = maxWidth;
+        atomic_fetch_add_explicit(&printLimits.clamped, 1, memory_order_relaxed);
+    }
+    if (maxPrecision > 0 && ps->precision > maxPrecision) {
+        ps->precision = maxPrecision;
+        atomic_fetch_add_explicit(&printLimits.clamped, 1, memory_order_relaxed);
+    }
+}
+
+//How much of out_size a single call may use.
+static size_t limitOutput(size_t out_size) {
+    unsigned int maxOutput = atomic_load_explicit(&printLimits.maxOutput, memory_order_relaxed);
+
+    if (maxOutput > 0 && out_size > maxOutput) {
+        atomic_fetch_add_explicit(&printLimits.clamped, 1, memory_order_relaxed);
+        return maxOutput;
+    }
+    return out_size;
+}
+
+static int printArgument(struct printSpecification *ps, char* output, unsigned int* outPos, size_t out_size, char spec, union printArgument arg){
+    limitSpecification(ps);
+
     //TODO: a, A, p, vN
     //DONE: d, i, u, c, s, o, x, X, f, F, e, E, g, G,
 
@@ -598,86 +770,83 @@ int printSpec(struct printSpecification *ps, char* output, unsigned int* outPos,
     switch (spec) {
         case 'g':
             ps->s = SPEC_LOWER_G;
-
-            return printShortestFloat(ps, output, outPos, out_size, va_arg(args, double));
+            return printShortestFloat(ps, output, outPos, out_size, arg.d);
         case 'G':
             ps->s = SPEC_UPPER_G;
-            return printShortestFloat(ps, output, outPos, out_size, va_arg(args, double));
+            return printShortestFloat(ps, output, outPos, out_size, arg.d);
         case 'f':
             ps->s = SPEC_LOWER_F;
-            return printFloat(ps, output, outPos, out_size, va_arg(args, double));
+            return printFloat(ps, output, outPos, out_size, arg.d);
         case 'F':
             ps->s = SPEC_UPPER_F;
-            return printFloat(ps, output, outPos, out_size, va_arg(args, double));
+            return printFloat(ps, output, outPos, out_size, arg.d);
         case 'e':
             ps->s = SPEC_LOWER_E;
-            return printScientific(ps, output, outPos, out_size, va_arg(args, double));
+            return printScientific(ps, output, outPos, out_size, arg.d);
         case 'E':
             ps->s = SPEC_UPPER_E;
-            return printScientific(ps, output, outPos, out_size, va_arg(args, double));
+            return printScientific(ps, output, outPos, out_size, arg.d);
         case 's':
             ps->s = SPEC_S;
-            return printString(ps, output, outPos, out_size, va_arg(args, char*));
+            return printString(ps, output, outPos, out_size, arg.s);
         case 'c':
             ps->s = SPEC_C;
-            return printChar(output, va_arg(args, int), outPos, out_size) ? 0 : -1;
+            return printChar(output, (int) arg.i, outPos, out_size) ? 0 : -1;
         case 'o':
             ps->s = SPEC_O;
-            if (ps->length != l)
-                return printOctal(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned int));
-            else
-                return printOctal(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned long));
+            return printOctal(ps, output, outPos, out_size, arg.u);
         case 'd':
         case 'i':
             ps->s = SPEC_D;
-            if (ps->length != l)
-                return printLong(ps, output, outPos, out_size, (long) va_arg(args, int));
-            else
-                return printLong(ps, output, outPos, out_size, (long) va_arg(args, long));
+            return printLong(ps, output, outPos, out_size, arg.i);
         case 'u':
             ps->s = SPEC_U;
-            if (ps->length != l)
-                return printUnsignedLong(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned int));
-            else
-                return printUnsignedLong(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned long));
+            return printUnsignedLong(ps, output, outPos, out_size, arg.u);
         case 'x':
             ps->s = SPEC_LOWER_X;
-            if (ps->length != l)
-                return printHex(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned int));
-            else
-                return printHex(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned long));
+            return printHex(ps, output, outPos, out_size, arg.u);
         case 'X':
             ps->s = SPEC_UPPER_X;
-            if (ps->length != l)
-                return printHex(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned int));
-            else
-                return printHex(ps, output, outPos, out_size, (unsigned long) va_arg(args, unsigned long));
+            return printHex(ps, output, outPos, out_size, arg.u);
         default:
             //Invalid specifier
             return -1;
     }
 }
 
-static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsigned int *outPos, size_t out_size, va_list args) {
-    struct printSpecification ps;
-    int progress;
-    initPrintSpec(&ps);
-    char peek;
-
-    char next = fmt[(*fmtPos)++];
+int printSpec(struct printSpecification *ps, char* output, unsigned int* outPos, size_t out_size, char spec, va_list args){
+    union printArgument arg;
 
-    state curState = INITIAL;
-    if (next != '%') {
-        //print token
-        int printed = printChar(output, next, outPos, out_size);
-        return printed ? 0 : -1;
+    if (!readArgument(specArgType(spec, ps->length), &arg, args)) {
+        //Invalid specifier
+        return -1;
     }
+    return printArgument(ps, output, outPos, out_size, spec, arg);
+}
 
-    //Peek at next char and see if we got %%, and then just print % and bump fmtPos
-    if (fmt[*fmtPos] == '%') {
-        int printed = printChar(output, fmt[(*fmtPos)++], outPos, out_size);
-        return printed ? 0 : -1;
+//Reads a POSIX "n$" argument position. Returns n, or 0 (leaving *fmtPos alone) if there isn't one.
+static int readArgPosition(const char* fmt, unsigned int* fmtPos) {
+    unsigned int pos = *fmtPos;
+    unsigned int n;
+
+    if (fmt[pos] == '0' || !readUnsigned(fmt, &pos, &n) || fmt[pos] != '$') {
+        return 0;
     }
+    *fmtPos = pos + 1;
+    return n;
+}
+
+//Parses everything after the '%' of a conversion, up to and including the specifier.
+//The value/width/precision argument sources are recorded in src rather than read, so this can be shared
+//between the sequential va_list path and format compilation.
+static int parseSpecification(const char *fmt, unsigned int *fmtPos, struct printSpecification *ps, char *spec, argSources *src) {
+    int progress;
+    char peek;
+    state curState;
+
+    src->value = readArgPosition(fmt, fmtPos);
+    src->width = ARG_SOURCE_NONE;
+    src->precision = ARG_SOURCE_NONE;
 
     curState = READ_FLAGS;
     while (curState == READ_FLAGS) {
@@ -686,23 +855,23 @@ static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsign
         peek = fmt[*fmtPos];
         switch (peek) {
             case '-':
-                ps.f.leftJustify = 1;
+                ps->f.leftJustify = 1;
                 progress = 1;
                 break;
             case '+':
-                ps.f.forcePlusMinus = 1;
+                ps->f.forcePlusMinus = 1;
                 progress = 1;
                 break;
             case ' ':
-                ps.f.spacePrefixPositiveNumber = 1;
+                ps->f.spacePrefixPositiveNumber = 1;
                 progress = 1;
                 break;
             case '#':
-                ps.f.zeroPrefixedOrForceDecimal = 1;
+                ps->f.zeroPrefixedOrForceDecimal = 1;
                 progress = 1;
                 break;
             case '0':
-                ps.f.leftPadWithZeroes = 1;
+                ps->f.leftPadWithZeroes = 1;
                 progress = 1;
                 break;
         }
@@ -713,18 +882,18 @@ static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsign
             curState = READ_WIDTH;
         }
     }
-    if (ps.f.spacePrefixPositiveNumber && ps.f.forcePlusMinus) {
+    if (ps->f.spacePrefixPositiveNumber && ps->f.forcePlusMinus) {
         //If both flags are specified, the space prefix flag is ignored.
-        ps.f.spacePrefixPositiveNumber = 0;
+        ps->f.spacePrefixPositiveNumber = 0;
     }
 
-    //Get the width. Either a number or '*' which indicates consume the next var-arg value.
+    //Get the width. Either a number or '*' which indicates consume the next (or the n$'th) var-arg value.
     peek = fmt[*fmtPos];
     if (peek == '*') {
         (*fmtPos)++;
-        ps.width = va_arg(args, int);
+        src->width = readArgPosition(fmt, fmtPos);
     } else {
-        readUnsigned(fmt, fmtPos, &ps.width);
+        readUnsigned(fmt, fmtPos, &ps->width);
     }
 
     curState = READ_PRECISION;
@@ -734,11 +903,11 @@ static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsign
         peek = fmt[++(*fmtPos)];
         if (peek == '*') {
             (*fmtPos)++;
-            ps.precision = va_arg(args, int);
+            src->precision = readArgPosition(fmt, fmtPos);
         } else {
             //If just a "." is present, precision defaults to 0.
-            if (!readUnsigned(fmt, fmtPos, &ps.precision)) {
-                ps.precision = 0;
+            if (!readUnsigned(fmt, fmtPos, &ps->precision)) {
+                ps->precision = 0;
             }
         }
     }
@@ -747,35 +916,35 @@ static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsign
     peek = fmt[*fmtPos];
     if (peek == 'v') {
         (*fmtPos)++;
-        readUnsigned(fmt, fmtPos, &ps.vs);
+        readUnsigned(fmt, fmtPos, &ps->vs);
     }
     curState = READ_LENGTH;
 
-    ps.length = LENGTH_DEFAULT;
+    ps->length = LENGTH_DEFAULT;
     while (curState == READ_LENGTH) {
         progress = 0;
 
         peek = fmt[*fmtPos];
         if (peek == 'h') {
-            switch (ps.length) {
+            switch (ps->length) {
                 case LENGTH_DEFAULT:
-                    ps.length = h;
+                    ps->length = h;
                     progress = 1;
                     break;
                 case h:
-                    ps.length = hh;
+                    ps->length = hh;
                     progress = 1;
                     break;
             }
         }
         if (peek == 'l') {
-            switch (ps.length) {
+            switch (ps->length) {
                 case LENGTH_DEFAULT:
-                    ps.length = l;
+                    ps->length = l;
                     progress = 1;
                     break;
                 case h:
-                    ps.length = hl;
+                    ps->length = hl;
                     progress = 1;
                     break;
             }
@@ -792,141 +961,3764 @@ static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsign
     }
 
     if (curState == READ_SPECIFIER) {
-        char spec = fmt[(*fmtPos)++];
-        return printSpec(&ps, output, outPos, out_size, spec, args);
+        *spec = fmt[(*fmtPos)++];
+        return 0;
     } else {
         printf("ERROR: I should be reading a specifier here... but I'm not\n");
         return -1;
     }
 }
 
-static int myPrintf(char* output, size_t out_size, const char* fmt, va_list args) {
-    unsigned int fmtPos = 0;
-    unsigned int outPos = 0;
-    int ret = 0;
+//Number of decimal digits in value, from a digit-count table rather than by dividing.
+static unsigned int decimalDigits(unsigned long value) {
+    static const unsigned long powersOf10[] = {
+        1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL,
+        10000000000UL, 100000000000UL, 1000000000000UL, 10000000000000UL, 100000000000000UL,
+        1000000000000000UL, 10000000000000000UL, 100000000000000000UL, 1000000000000000000UL,
+        10000000000000000000UL
+    };
+    unsigned int bits = 64 - __builtin_clzl(value | 1);
+    //bits * log10(2), which is either the digit count or one short of it.
+    unsigned int guess = (bits * 1233) >> 12;
+    return guess + (guess < 20 && value >= powersOf10[guess]);
+}
 
+//A conversion laid out from a small rendering of it: core, with zeroes '0's inserted at zeroesAt and pad copies of
+//padChar inserted at padAt. Conversions too big for the buffer are measured and cut short this way, so the work
+//depends on the room left rather than on the width or precision asked for. Floats are rendered with their precision
+//capped where extra precision only adds zeroes, and the zeroes' place is found by rendering one more digit; the
+//padding's place and character are found by rendering one column wider than the core.
+#define SHAPE_CORE_SIZE 1024
+//%g and %G switch between the %e and %f layouts depending on the precision up to the largest decimal exponent.
+#define SHAPE_SHORTEST_DIGITS 352
+
+struct conversionShape {
+    char *core;
+    size_t coreLength;
+    size_t zeroes;
+    size_t zeroesAt;
+    size_t pad;
+    size_t padAt;
+    char padChar;
+    char stackCore[SHAPE_CORE_SIZE];
+};
 
-    //    printf("format is: %s", fmt);
+static size_t firstDifference(const char* a, size_t length, const char* b) {
+    size_t i = 0;
+    while (i < length && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
 
-    //Get the next argument as an integer
-    //va_arg(args, int);
+static size_t conversionRender(const struct printSpecification *ps, int width, int precision, char spec, union printArgument arg, char* output, size_t size) {
+    struct printSpecification copy = *ps;
+    unsigned int pos = 0;
 
-    //While output has written less than size and fmt string is not exhausted
-    //Read next char
-    //If in initial state and char is not %, print that char.
-    //Might need to deal with escaped characters
-    //If next char is %, go to READING_FLAGS
-    //Read flags of -+<space>#0 for:
-    //  "-" left justify within field width
-    //  "+" force display of "+"/"-" , even for negatives. Default is just "-" for negatives
-    //  <space> If no sign is written, insert blank space before value.
-    //  "#" controls 0, 0x, 0X prefix for hex values, forces decimal point for floats/doubles even if no trailing decimal value.
-    //  "0" Left pad with zeros to specified width value
-    //
-    //If something else read, then move state to READ_WIDTH
-    //  (number) Read a number of characters of field width.
-    //  "*" Read the number of characters of width from the next unused argument
-    //
-    //Next, move state to READ_PRECISION
-    //  .(number) For integers, minimum number of digits (leading zero padding)
-    //            For floats, number of digits after decimal point (default 6).
-    //
-    //Move to READ_VECTOR_SIZE
-    //  vN - Size of vector argument to print
-    //
-    //Next, move to READ_LENGTH
-    //  values: none, hh, h, hl (only valid for vector specifiers), l
-    // Any values printed to a given length must be cast before printing. Implicit cast between vector types are not allowed.
-    //
-    //Lastly, move to READ_SPECIFIER
-    //  values: d, i, u, x, X, f, F, e, E, g, G, a, A, c, s, p, n
+    copy.width = width;
+    copy.precision = precision;
+    printArgument(&copy, output, &pos, size, spec, arg);
+    return pos;
+}
 
-    char nextChar;
-    while ((nextChar = fmt[fmtPos]) != 0 && outPos < out_size && !ret) {
-        ret = nextToken(fmt, &fmtPos, output, &outPos, out_size, args);
+static void conversionShapeFree(struct conversionShape *shape) {
+    if (shape->core != shape->stackCore) {
+        free(shape->core);
     }
+}
 
-    //Always null-terminate the output buffer.
-    if (outPos < out_size - 1) {
-        output[outPos] = '\0';
-    } else {
-        output[outPos - 1 - 1] = '\0';
+static int conversionShapeInit(struct conversionShape *shape, const struct printSpecification *ps, char spec, union printArgument arg) {
+    int isFloat = spec == 'f' || spec == 'F' || spec == 'e' || spec == 'E' || spec == 'g' || spec == 'G';
+    int cap = spec == 'g' || spec == 'G' ? SHAPE_SHORTEST_DIGITS : FLOAT_FRACTION_DIGITS;
+    int precision = isFloat && ps->precision > cap ? cap : ps->precision;
+    size_t size = SHAPE_CORE_SIZE + (spec == 's' ? (ps->precision >= 0 ? strnlen(arg.s, ps->precision) : strlen(arg.s)) : 0);
+    char stackWider[SHAPE_CORE_SIZE];
+    char *wider = size <= SHAPE_CORE_SIZE ? stackWider : malloc(size);
+
+    shape->core = size <= SHAPE_CORE_SIZE ? shape->stackCore : malloc(size);
+    if (!shape->core || !wider) {
+        if (wider != stackWider) {
+            free(wider);
+        }
+        conversionShapeFree(shape);
+        return -1;
+    }
+    shape->coreLength = conversionRender(ps, -1, precision, spec, arg, shape->core, size);
+    shape->zeroes = shape->zeroesAt = shape->pad = shape->padAt = 0;
+    shape->padChar = ' ';
+
+    if (precision != ps->precision
+        && conversionRender(ps, -1, precision + 1, spec, arg, wider, size) == shape->coreLength + 1) {
+        shape->zeroes = ps->precision - precision;
+        shape->zeroesAt = firstDifference(shape->core, shape->coreLength, wider);
+    }
+    if (ps->width > 0) {
+        //Some conversions leave part of themselves out of the width, like the 0x of %#x, which shows up as more
+        //than one column of padding here.
+        size_t padded = conversionRender(ps, shape->coreLength + 1, precision, spec, arg, wider, size);
+        size_t uncounted = padded > shape->coreLength ? padded - shape->coreLength - 1 : 0;
+        size_t counted = shape->coreLength + shape->zeroes - uncounted;
+        if (padded > shape->coreLength && (size_t) ps->width > counted) {
+            shape->pad = ps->width - counted;
+            shape->padAt = firstDifference(shape->core, shape->coreLength, wider);
+            shape->padChar = wider[shape->padAt];
+        }
     }
+    if (wider != stackWider) {
+        free(wider);
+    }
+    return 0;
+}
 
-    //What would we consider a non-successful printf?
-    //Running out of space in the buffer? Invalid format/#(arguments)?
-    return ret;
+static size_t conversionShapeLength(const struct conversionShape *shape) {
+    return shape->coreLength + shape->zeroes + shape->pad;
 }
 
-int compareOutput(char *output, char* expected, const char* fmt){
-    if (strcmp(expected, output)) {
-        printf("Difference between system and myPrintf for pattern:\n%s\n", fmt);
-        printf("Expected/System:%s\nprintf.........:%s\n\n", expected, output);
-    } else {
-        printf("Correct result. Buffer: %s\n\n", output);
+//Copies as much of the laid out conversion as fits in output.
+static void conversionShapeCopy(const struct conversionShape *shape, char* output, unsigned int *outPos, size_t out_size) {
+    struct {
+        size_t at;
+        size_t count;
+        char c;
+    } inserts[2] = {
+        {shape->zeroesAt, shape->zeroes, '0'},
+        {shape->padAt, shape->pad, shape->padChar}
+    }, swap;
+    size_t from = 0;
+
+    //Padding at the same place as the zeroes goes ahead of them, unless it's trailing padding.
+    if (inserts[1].at < inserts[0].at || (inserts[1].at == inserts[0].at && inserts[1].at < shape->coreLength)) {
+        swap = inserts[0];
+        inserts[0] = inserts[1];
+        inserts[1] = swap;
+    }
+    for (unsigned int i = 0; i <= 2 && *outPos < out_size; i++) {
+        size_t upTo = i < 2 ? inserts[i].at : shape->coreLength;
+        size_t n = upTo - from < out_size - *outPos ? upTo - from : out_size - *outPos;
+        memcpy(output + *outPos, shape->core + from, n);
+        *outPos += n;
+        from = upTo;
+        if (i < 2) {
+            n = inserts[i].count < out_size - *outPos ? inserts[i].count : out_size - *outPos;
+            memset(output + *outPos, inserts[i].c, n);
+            *outPos += n;
+        }
     }
-    return strcmp(expected, output);
 }
 
-int testPatternWithExpected(char *buffer, size_t buffer_size, char* expected, const char* fmt, ...) {
-    //First, clear the output buffer.
-    memset(buffer, 0, sizeof (buffer));
+//How many characters printArgument would print for this conversion given unlimited space.
+//Integers and strings are measured without printing them. Floats are measured from a conversionShape.
+static size_t measureArgument(const struct printSpecification *ps, char spec, union printArgument arg) {
+    struct printSpecification copy = *ps;
+    size_t len;
 
-    va_list args;
+    limitSpecification(&copy);
+    ps = &copy;
 
-    va_start(args, fmt);
-    myPrintf(buffer, buffer_size, fmt, args);
-    va_end(args);
+    switch (spec) {
+        case 'd':
+        case 'i': {
+            long value = wrapSignedValueToSize(&copy, arg.i);
+            if (value == 0 && ps->precision == 0) {
+                return 0;
+            }
+            len = decimalDigits(value < 0 ? 0 - (unsigned long) value : (unsigned long) value)
+                + (value < 0 || ps->f.forcePlusMinus || ps->f.spacePrefixPositiveNumber);
+            break;
+        }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            unsigned long value = wrapValueToSize(&copy, arg.u);
+            unsigned int bits = 64 - __builtin_clzl(value | 1);
+            if (value == 0 && ps->precision == 0) {
+                return 0;
+            }
+            len = spec == 'u' ? decimalDigits(value) : spec == 'o' ? (bits + 2) / 3 : (bits + 3) / 4;
+            if ((spec == 'x' || spec == 'X') && ps->f.zeroPrefixedOrForceDecimal) {
+                //printHex pads the digits to the width and then adds the 0x in front.
+                return 2 + (ps->width > (int) len ? (size_t) ps->width : len);
+            }
+            break;
+        }
+        case 's':
+            len = ps->precision >= 0 ? strnlen(arg.s, ps->precision) : strlen(arg.s);
+            break;
+        case 'c':
+            return 1;
+        default: {
+            struct conversionShape shape;
+            if (conversionShapeInit(&shape, &copy, spec, arg) < 0) {
+                return 0;
+            }
+            len = conversionShapeLength(&shape);
+            conversionShapeFree(&shape);
+            return len;
+        }
+    }
+    return ps->width > (int) len ? (size_t) ps->width : len;
+}
 
-    return compareOutput(buffer, expected, fmt);
+//printArgument for callers that want to know the full length of their output. Whatever doesn't fit is added to
+//*overflow, and once the buffer is full conversions are only measured.
+static int printArgumentMeasured(struct printSpecification *ps, char* output, unsigned int *outPos, size_t out_size, char spec, union printArgument arg, size_t *overflow) {
+    struct printSpecification original;
+    struct conversionShape shape;
+    unsigned int startPos = *outPos;
+    size_t full;
+    int ret;
+
+    limitSpecification(ps);
+    original = *ps;
+
+    if (*outPos >= out_size) {
+        *overflow += measureArgument(&original, spec, arg);
+        return 0;
+    }
+    ret = printArgument(ps, output, outPos, out_size, spec, arg);
+    if (*outPos < out_size) {
+        return ret;
+    }
+
+    //We filled the buffer, so this may have been cut short, and the emitters don't leave a clean prefix behind
+    //when they run out of space part way through padding.
+    if (conversionShapeInit(&shape, &original, spec, arg) < 0) {
+        return -1;
+    }
+    full = conversionShapeLength(&shape);
+    if (full > out_size - startPos) {
+        *outPos = startPos;
+        conversionShapeCopy(&shape, output, outPos, out_size);
+        *overflow += full - (out_size - startPos);
+    }
+    conversionShapeFree(&shape);
+    return 0;
 }
 
-int testPattern(char *buffer, size_t buffer_size, const char* fmt, ...) {
-    char cpuOutput[buffer_size];
+//Prints the next literal character or conversion of fmt. If overflow is given, a full buffer isn't an error:
+//the rest is measured and its length added to *overflow.
+static int nextToken(const char *fmt, unsigned int *fmtPos, char *output, unsigned int *outPos, size_t out_size, va_list args, size_t *overflow) {
+    struct printSpecification ps;
+    union printArgument arg;
+    argSources src;
+    char spec;
+    initPrintSpec(&ps);
 
-    //First, clear the output buffer.
-    memset(buffer, 0, sizeof (buffer));
+    char next = fmt[(*fmtPos)++];
 
-    va_list args;
+    if (next != '%') {
+        //print token
+        int printed = printChar(output, next, outPos, out_size);
+        if (!printed && overflow) {
+            (*overflow)++;
+            return 0;
+        }
+        return printed ? 0 : -1;
+    }
 
-    va_start(args, fmt);
-    vsprintf(cpuOutput, fmt, args);
-    va_end(args);
+    //Peek at next char and see if we got %%, and then just print % and bump fmtPos
+    if (fmt[*fmtPos] == '%') {
+        int printed = printChar(output, fmt[(*fmtPos)++], outPos, out_size);
+        if (!printed && overflow) {
+            (*overflow)++;
+            return 0;
+        }
+        return printed ? 0 : -1;
+    }
 
-    va_start(args, fmt);
-    myPrintf(buffer, buffer_size, fmt, args);
-    va_end(args);
+    if (parseSpecification(fmt, fmtPos, &ps, &spec, &src) < 0) {
+        return -1;
+    }
+    if (src.value > 0) {
+        //Positional arguments can't be read sequentially, let the caller compile the format instead.
+        return TOKEN_POSITIONAL;
+    }
+    if (src.width != ARG_SOURCE_NONE) {
+        if (src.width > 0) return -1;
+        ps.width = va_arg(args, int);
+    }
+    if (src.precision != ARG_SOURCE_NONE) {
+        if (src.precision > 0) return -1;
+        ps.precision = va_arg(args, int);
+    }
+    if (!readArgument(specArgType(spec, ps.length), &arg, args)) {
+        //Invalid specifier
+        return -1;
+    }
+    if (overflow) {
+        return printArgumentMeasured(&ps, output, outPos, out_size, spec, arg, overflow);
+    }
+    return printArgument(&ps, output, outPos, out_size, spec, arg);
+}
 
-    return compareOutput(buffer, cpuOutput, fmt);
+//Records that argument n (1-based) of a compiled format has the given type. Returns the argument's index in the
+//argument block, or -1 if the format uses the argument inconsistently or has too many arguments.
+static int addCompiledArg(struct compiledFormat *cf, int n, argType type) {
+    if (n <= 0 || n > MAX_COMPILED_ARGS) {
+        return -1;
+    }
+    if (cf->argTypes[n - 1] != ARG_NONE && cf->argTypes[n - 1] != type) {
+        return -1;
+    }
+    cf->argTypes[n - 1] = type;
+    if (n > cf->numArgs) {
+        cf->numArgs = n;
+    }
+    return n - 1;
 }
 
-int main() {
-    char buffer[1024];
-    size_t bufSize = sizeof (buffer);
+//Compiles fmt into a list of literal/conversion segments, resolving where every conversion's value, width and
+//precision live in the argument list. Formats either use POSIX positional arguments ("%2$d", "%*1$d") for every
+//conversion or for none of them.
+//Returns 0 on success, -1 if the format is invalid or exceeds the compiled format limits.
+static int compileFormat(struct compiledFormat *cf, const char* fmt) {
+    unsigned int fmtPos = 0;
+    unsigned int literalStart = 0;
+    int nextSequentialArg = 1;
+    int positional = -1;
 
-    printf("TODO: Add checking for end of format string while reading flags/length/precision/etc\n");
+    memset(cf, 0, sizeof (*cf));
+    cf->fmt = fmt;
 
-    testPattern(buffer, bufSize, "hello%%, :%010.7s%s:           asdfasdf\n", "world..........", "");
+    for (;;) {
+        struct formatSegment *seg;
+        argSources src;
+        argType type;
 
-    testPattern(buffer, bufSize, ":%07.10s:%c:%d:%+d:%i\n", "hello", 'T', 1, 1234, -1024);
+        //Extend the literal up to the next conversion or the end of the format.
+        while (fmt[fmtPos] != 0 && fmt[fmtPos] != '%') {
+            fmtPos++;
+        }
 
-    testPattern(buffer, bufSize, ":%hhd:%hd:%d:%ld:\n", 128, 32768, 65536, 4294967295);
+        if (cf->numSegments == MAX_FORMAT_SEGMENTS) {
+            return -1;
+        }
+        seg = &cf->segments[cf->numSegments++];
+        seg->literalStart = literalStart;
+        seg->literalLength = fmtPos - literalStart;
+        seg->spec = 0;
+        seg->valueArg = seg->widthArg = seg->precisionArg = -1;
+
+        if (fmt[fmtPos] == 0) {
+            return 0;
+        }
+        if (fmt[fmtPos + 1] == '%') {
+            //Keep the first '%' of "%%" as the end of this literal, and start the next literal after the second.
+            seg->literalLength++;
+            fmtPos += 2;
+            literalStart = fmtPos;
+            continue;
+        }
 
-    printf("Expect the following to fail. ");
-    printf("system printf seems to grant precedence to the '0' flag, not the '-' flag.\n");
-    testPattern(buffer, bufSize, ":%-0.7d:\n", 32768);
-    //Both rules should be part of a number padding function:
-    //If the 0 flag was specified, pad with zeroes to field width, If '0' and '-' flags are both specified, ignore '0'.
-    //If a precision is specified, the '0' flag is ignored.
+        fmtPos++;
+        initPrintSpec(&seg->ps);
+        if (parseSpecification(fmt, &fmtPos, &seg->ps, &seg->spec, &src) < 0) {
+            return -1;
+        }
+        literalStart = fmtPos;
 
-    testPattern(buffer, bufSize, ":%hhd:%hd:%d:%ld:\n", 128, 32768, 65536, 4294967295);
+        //Either every conversion is positional or none are.
+        if (positional < 0) {
+            positional = src.value > 0;
+        }
+        if (positional != (src.value > 0)
+            || (src.width != ARG_SOURCE_NONE && positional != (src.width > 0))
+            || (src.precision != ARG_SOURCE_NONE && positional != (src.precision > 0))) {
+            return -1;
+        }
 
-    //Right justified string
-    testPattern(buffer, bufSize, "^%10s^", "test");
-    //Right justified integer
-    testPattern(buffer, bufSize, "^%10d^", 10);
-    //Right justified integer with leading zeroes
-    testPattern(buffer, bufSize, "^%010d^", 10);
+        if (src.width != ARG_SOURCE_NONE) {
+            seg->widthArg = addCompiledArg(cf, positional ? src.width : nextSequentialArg++, ARG_INT);
+            if (seg->widthArg < 0) return -1;
+        }
+        if (src.precision != ARG_SOURCE_NONE) {
+            seg->precisionArg = addCompiledArg(cf, positional ? src.precision : nextSequentialArg++, ARG_INT);
+            if (seg->precisionArg < 0) return -1;
+        }
+        type = specArgType(seg->spec, seg->ps.length);
+        if (type == ARG_NONE) {
+            return -1;
+        }
+        seg->valueArg = addCompiledArg(cf, positional ? src.value : nextSequentialArg++, type);
+        if (seg->valueArg < 0) return -1;
+    }
+}
+
+//Formats a compiled format into output starting at *outPos, without null-terminating.
+//Every argument is read from the va_list exactly once, in order, into a packed argument block, and each
+//conversion then fetches its value from the block by index.
+static int readArgBlock(const struct compiledFormat *cf, union printArgument *argBlock, va_list args) {
+    for (unsigned int i = 0; i < cf->numArgs; i++) {
+        //A gap in the positional arguments means we can't know how to step over it.
+        if (!readArgument(cf->argTypes[i], &argBlock[i], args)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Prints a compiled format from its argument block. If overflow is given, a full buffer isn't an error: the rest
+//is measured and its length added to *overflow.
+static int formatArgBlockMeasured(const struct compiledFormat *cf, char* output, unsigned int *outPos, size_t out_size, const union printArgument *argBlock, size_t *overflow) {
+    for (unsigned int i = 0; i < cf->numSegments && (overflow || *outPos < out_size); i++) {
+        const struct formatSegment *seg = &cf->segments[i];
+        struct printSpecification ps;
+        unsigned int literalLength = seg->literalLength;
+
+        if (literalLength > out_size - *outPos) {
+            literalLength = *outPos < out_size ? out_size - *outPos : 0;
+            if (overflow) {
+                *overflow += seg->literalLength - literalLength;
+            }
+        }
+        memcpy(output + *outPos, cf->fmt + seg->literalStart, literalLength);
+        *outPos += literalLength;
+
+        if (!seg->spec || (!overflow && *outPos >= out_size)) {
+            continue;
+        }
+        ps = seg->ps;
+        if (seg->widthArg >= 0) {
+            ps.width = (int) argBlock[seg->widthArg].i;
+        }
+        if (seg->precisionArg >= 0) {
+            ps.precision = (int) argBlock[seg->precisionArg].i;
+        }
+        if (overflow) {
+            if (printArgumentMeasured(&ps, output, outPos, out_size, seg->spec, argBlock[seg->valueArg], overflow) < 0) {
+                return -1;
+            }
+        } else if (printArgument(&ps, output, outPos, out_size, seg->spec, argBlock[seg->valueArg]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int formatArgBlock(const struct compiledFormat *cf, char* output, unsigned int *outPos, size_t out_size, const union printArgument *argBlock) {
+    return formatArgBlockMeasured(cf, output, outPos, out_size, argBlock, NULL);
+}
+
+static int formatCompiledMeasured(const struct compiledFormat *cf, char* output, unsigned int *outPos, size_t out_size, va_list args, size_t *overflow) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+
+    if (readArgBlock(cf, argBlock, args) < 0) {
+        return -1;
+    }
+    return formatArgBlockMeasured(cf, output, outPos, out_size, argBlock, overflow);
+}
+
+static int formatCompiled(const struct compiledFormat *cf, char* output, unsigned int *outPos, size_t out_size, va_list args) {
+    return formatCompiledMeasured(cf, output, outPos, out_size, args, NULL);
+}
+
+//Format the whole of fmt into output starting at *outPos, without null-terminating.
+//Returns 0 on success and -1 on failure, same as nextToken. If overflow is given, formatting carries on past the
+//end of the buffer in length-only mode, adding what didn't fit to *overflow.
+static int formatTokensMeasured(const char* fmt, char* output, unsigned int *outPos, size_t out_size, va_list args, size_t *overflow) {
+    unsigned int fmtPos = 0;
+    unsigned int startPos = *outPos;
+    size_t startOverflow = overflow ? *overflow : 0;
+    int ret = 0;
+
+    while (fmt[fmtPos] != 0 && (overflow || *outPos < out_size) && !ret) {
+        ret = nextToken(fmt, &fmtPos, output, outPos, out_size, args, overflow);
+    }
+
+    if (ret == TOKEN_POSITIONAL) {
+        //Positional formats go through a one-off compilation. Any literal text we printed before the first
+        //conversion is printed again by the compiled format.
+        struct compiledFormat cf;
+        if (compileFormat(&cf, fmt) < 0) {
+            return -1;
+        }
+        *outPos = startPos;
+        if (overflow) {
+            *overflow = startOverflow;
+        }
+        ret = formatCompiledMeasured(&cf, output, outPos, out_size, args, overflow);
+    }
+    return ret;
+}
+
+static int formatTokens(const char* fmt, char* output, unsigned int *outPos, size_t out_size, va_list args) {
+    return formatTokensMeasured(fmt, output, outPos, out_size, args, NULL);
+}
+
+//Variadic form of formatTokens, for callers that format a single value into part of a larger buffer.
+static int formatAt(char* output, unsigned int *outPos, size_t out_size, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = formatTokens(fmt, output, outPos, out_size, args);
+    va_end(args);
+    return ret;
+}
+
+//formatAt that adds whatever doesn't fit to *overflow.
+static int formatAtMeasured(char* output, unsigned int *outPos, size_t out_size, size_t *overflow, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = formatTokensMeasured(fmt, output, outPos, out_size, args, overflow);
+    va_end(args);
+    return ret;
+}
+
+//Tracing: begin/end events for myPrintf calls, shared buffer publishes and flushes, and capture decoding,
+//written out as Chrome trace JSON (chrome://tracing, Perfetto). Each thread appends to its own buffer, so recording
+//an event takes no locks. Buffers live until traceReset, which frees them all, including those of threads that
+//have since exited. Tracing is compiled in unless PRINTF_NO_TRACE is defined, and costs one relaxed load per
+//event until traceEnable turns it on.
+#define TRACE_EVENTS_PER_THREAD 65536
+
+struct traceEvent {
+    uint64_t timestamp;
+    const char *name;
+    char phase;
+};
+
+struct traceBuffer {
+    struct traceBuffer *next;
+    unsigned int tid;
+    atomic_uint count;
+    atomic_ulong dropped;
+    struct traceEvent events[TRACE_EVENTS_PER_THREAD];
+};
+
+static atomic_int traceEnabled;
+static struct traceBuffer *_Atomic traceBuffers;
+static atomic_uint traceNextTid;
+//Bumped by traceReset, so that threads know their buffer was freed.
+static atomic_uint traceGeneration;
+static _Thread_local struct traceBuffer *traceLocal;
+static _Thread_local unsigned int traceLocalGeneration;
+
+static void traceEnable(int enabled) {
+    atomic_store(&traceEnabled, enabled);
+}
+
+//Registers this thread's buffer on first use by pushing it onto the list of all buffers.
+static struct traceBuffer* traceThreadBuffer() {
+    unsigned int generation = atomic_load_explicit(&traceGeneration, memory_order_relaxed);
+
+    if (!traceLocal || traceLocalGeneration != generation) {
+        struct traceBuffer *tb = calloc(1, sizeof (*tb));
+        traceLocal = NULL;
+        if (!tb) {
+            return NULL;
+        }
+        tb->tid = atomic_fetch_add(&traceNextTid, 1) + 1;
+        tb->next = atomic_load(&traceBuffers);
+        while (!atomic_compare_exchange_weak(&traceBuffers, &tb->next, tb)) {
+        }
+        traceLocal = tb;
+        traceLocalGeneration = generation;
+    }
+    return traceLocal;
+}
+
+static void traceRecord(const char* name, char phase) {
+    struct traceBuffer *tb = traceThreadBuffer();
+    struct timespec ts;
+    unsigned int n;
+
+    if (!tb) {
+        return;
+    }
+    n = atomic_load_explicit(&tb->count, memory_order_relaxed);
+    if (n == TRACE_EVENTS_PER_THREAD) {
+        atomic_fetch_add_explicit(&tb->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tb->events[n].timestamp = (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+    tb->events[n].name = name;
+    tb->events[n].phase = phase;
+    //Publish the event to traceWrite.
+    atomic_store_explicit(&tb->count, n + 1, memory_order_release);
+}
+
+#ifdef PRINTF_NO_TRACE
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#else
+#define TRACE_BEGIN(name) \
+    do { if (__builtin_expect(atomic_load_explicit(&traceEnabled, memory_order_relaxed), 0)) traceRecord(name, 'B'); } while (0)
+#define TRACE_END(name) \
+    do { if (__builtin_expect(atomic_load_explicit(&traceEnabled, memory_order_relaxed), 0)) traceRecord(name, 'E'); } while (0)
+#endif
+
+//Writes every thread's events as a Chrome trace JSON object, and the number of events lost to full buffers as
+//trace metadata. Returns the number of events written, or -1 if out couldn't be written.
+static long traceWrite(FILE* out) {
+    long written = 0;
+    unsigned long dropped = 0;
+
+    fputs("{\"traceEvents\":[", out);
+    for (struct traceBuffer *tb = atomic_load(&traceBuffers); tb; tb = tb->next) {
+        unsigned int count = atomic_load_explicit(&tb->count, memory_order_acquire);
+        for (unsigned int i = 0; i < count; i++) {
+            const struct traceEvent *e = &tb->events[i];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u}", written ? "," : "",
+                    e->name, e->phase, (unsigned long long) (e->timestamp / 1000), (unsigned int) (e->timestamp % 1000), tb->tid);
+            written++;
+        }
+        dropped += atomic_load(&tb->dropped);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"droppedEvents\":%lu}}\n", dropped);
+    return ferror(out) ? -1 : written;
+}
+
+//Throws away every thread's events and frees their buffers. Threads get a new buffer the next time they record.
+//Only safe while no thread is recording.
+static void traceReset() {
+    struct traceBuffer *tb = atomic_exchange(&traceBuffers, NULL);
+
+    atomic_fetch_add(&traceGeneration, 1);
+    while (tb) {
+        struct traceBuffer *next = tb->next;
+        free(tb);
+        tb = next;
+    }
+}
+
+//USDT probes for bpftrace/perf/systemtap, e.g. bpftrace -e 'usdt:./printf:printf:truncated { ... }'. Each probe
+//is a single nop plus an ELF note saying where it is and where its arguments live, so an unattached probe costs only
+//the nop. We use sys/sdt.h when it's there, and otherwise emit the same .note.stapsdt layout ourselves on x86-64.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PRINTF_HAVE_SDT_H
+#endif
+#endif
+
+#if defined(PRINTF_HAVE_SDT_H)
+#include <sys/sdt.h>
+#define PRINTF_PROBE2(name, a, b) DTRACE_PROBE2(printf, name, a, b)
+#define PRINTF_PROBE3(name, a, b, c) DTRACE_PROBE3(printf, name, a, b, c)
+#elif defined(__x86_64__) && defined(__ELF__) && defined(__GNUC__)
+#define PRINTF_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"printf\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+#define PRINTF_PROBE2(name, a, b) \
+    __asm__ __volatile__(PRINTF_PROBE_NOTE(name, "8@%0 8@%1") :: "nor" ((uint64_t) (a)), "nor" ((uint64_t) (b)))
+#define PRINTF_PROBE3(name, a, b, c) \
+    __asm__ __volatile__(PRINTF_PROBE_NOTE(name, "8@%0 8@%1 8@%2") \
+                         :: "nor" ((uint64_t) (a)), "nor" ((uint64_t) (b)), "nor" ((uint64_t) (c)))
+#else
+#define PRINTF_PROBE2(name, a, b)
+#define PRINTF_PROBE3(name, a, b, c)
+#endif
+
+struct workloadRecorder;
+static struct workloadRecorder *_Atomic workloadRecorder;
+//myPrintf calls that may be using the attached recorder, which workloadRecordStop waits out before freeing it.
+static atomic_uint workloadRecordCalls;
+static void workloadRecord(const char* fmt, va_list args);
+
+static void terminateOutput(char* output, unsigned int outPos, size_t out_size) {
+    //Always null-terminate the output buffer, giving up the last character if it's full.
+    if (out_size == 0) {
+        return;
+    }
+    output[outPos < out_size ? outPos : out_size - 1] = '\0';
+}
+
+//How much of an out_size buffer gets printed into: all of it but the terminator, subject to the output limit.
+static size_t outputSpace(size_t out_size) {
+    return limitOutput(out_size ? out_size - 1 : 0);
+}
+
+static int myPrintf(char* output, size_t out_size, const char* fmt, va_list args) {
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    int ret = 0;
+
+
+    //    printf("format is: %s", fmt);
+
+    //Get the next argument as an integer
+    //va_arg(args, int);
+
+    //While output has written less than size and fmt string is not exhausted
+    //Read next char
+    //If in initial state and char is not %, print that char.
+    //Might need to deal with escaped characters
+    //If next char is %, go to READING_FLAGS
+    //Read flags of -+<space>#0 for:
+    //  "-" left justify within field width
+    //  "+" force display of "+"/"-" , even for negatives. Default is just "-" for negatives
+    //  <space> If no sign is written, insert blank space before value.
+    //  "#" controls 0, 0x, 0X prefix for hex values, forces decimal point for floats/doubles even if no trailing decimal value.
+    //  "0" Left pad with zeros to specified width value
+    //
+    //If something else read, then move state to READ_WIDTH
+    //  (number) Read a number of characters of field width.
+    //  "*" Read the number of characters of width from the next unused argument
+    //
+    //Next, move state to READ_PRECISION
+    //  .(number) For integers, minimum number of digits (leading zero padding)
+    //            For floats, number of digits after decimal point (default 6).
+    //
+    //Move to READ_VECTOR_SIZE
+    //  vN - Size of vector argument to print
+    //
+    //Next, move to READ_LENGTH
+    //  values: none, hh, h, hl (only valid for vector specifiers), l
+    // Any values printed to a given length must be cast before printing. Implicit cast between vector types are not allowed.
+    //
+    //Lastly, move to READ_SPECIFIER
+    //  values: d, i, u, x, X, f, F, e, E, g, G, a, A, c, s, p, n
+
+    //Like snprintf, leave room for the terminator and return the length the whole output would have had, with
+    //everything past the end of the buffer measured rather than printed.
+    TRACE_BEGIN("myPrintf");
+    PRINTF_PROBE2(format_entry, fmt, out_size);
+    if (atomic_load_explicit(&workloadRecorder, memory_order_relaxed)) {
+        va_list recordArgs;
+        va_copy(recordArgs, args);
+        workloadRecord(fmt, recordArgs);
+        va_end(recordArgs);
+    }
+    ret = formatTokensMeasured(fmt, output, &outPos, outputSpace(out_size), args, &overflow);
+    terminateOutput(output, outPos, out_size);
+    if (overflow) {
+        PRINTF_PROBE3(truncated, fmt, outPos + overflow, outPos);
+    }
+    PRINTF_PROBE2(format_return, fmt, ret < 0 ? -1 : (long) (outPos + overflow));
+    TRACE_END("myPrintf");
+
+    //Running out of space in the buffer isn't a failure, only an invalid format is.
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//myPrintf for a format compiled ahead of time with compileFormat.
+static int printCompiled(const struct compiledFormat *cf, char* output, size_t out_size, ...) {
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    va_start(args, out_size);
+    ret = formatCompiledMeasured(cf, output, &outPos, outputSpace(out_size), args, &overflow);
+    va_end(args);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Print a rows x cols matrix of doubles as right-aligned columns, one row per line, with each cell
+//formatted by cellFmt (e.g. "%.3f") and columns separated by a single space.
+//
+//Every cell is rendered exactly once: first compactly, back to back, at the start of the output
+//buffer while its length is recorded, which gives us the width of every column in a single pass.
+//The compact cells are then moved into their final padded positions, walking backwards from the
+//last cell. Since a cell's final position is never before its compact position, the move can
+//never overwrite a cell we haven't placed yet.
+//
+//Returns the number of characters written (excluding the null terminator), or -1 if the table
+//doesn't fit in the output buffer.
+static int myPrintTable(char* output, size_t out_size, const char* cellFmt, const double* values, unsigned int rows, unsigned int cols) {
+    unsigned int numCells = rows * cols;
+    unsigned int outPos = 0;
+    unsigned int *cellEnds;
+    unsigned int *colWidths;
+    unsigned int *colEnds;
+    unsigned int rowWidth = 0;
+    size_t tableSize;
+
+    if (out_size == 0) {
+        return -1;
+    }
+    if (numCells == 0) {
+        output[0] = '\0';
+        return 0;
+    }
+
+    cellEnds = malloc(sizeof (unsigned int) * (numCells + 2 * cols));
+    if (!cellEnds) {
+        return -1;
+    }
+    colWidths = cellEnds + numCells;
+    colEnds = colWidths + cols;
+    memset(colWidths, 0, sizeof (unsigned int) * cols);
+
+    //Render every cell back to back, leaving room for the null terminator.
+    for (unsigned int cell = 0; cell < numCells; cell++) {
+        unsigned int cellStart = outPos;
+        if (formatAt(output, &outPos, out_size - 1, cellFmt, values[cell]) < 0 || outPos >= out_size - 1) {
+            free(cellEnds);
+            return -1;
+        }
+        cellEnds[cell] = outPos;
+        if (outPos - cellStart > colWidths[cell % cols]) {
+            colWidths[cell % cols] = outPos - cellStart;
+        }
+    }
+
+    //Each row is every column plus a separator or newline after it.
+    for (unsigned int col = 0; col < cols; col++) {
+        rowWidth += colWidths[col] + 1;
+        colEnds[col] = rowWidth;
+    }
+    tableSize = (size_t) rowWidth * rows;
+    if (tableSize >= out_size) {
+        free(cellEnds);
+        return -1;
+    }
+
+    //Move the cells into place from the back, right-justifying each within its column.
+    output[tableSize] = '\0';
+    for (unsigned int cell = numCells; cell-- > 0;) {
+        unsigned int col = cell % cols;
+        unsigned int cellStart = cell ? cellEnds[cell - 1] : 0;
+        unsigned int cellLength = cellEnds[cell] - cellStart;
+        size_t fieldEnd = (size_t) (cell / cols) * rowWidth + colEnds[col];
+
+        memmove(output + fieldEnd - 1 - cellLength, output + cellStart, cellLength);
+        memset(output + fieldEnd - 1 - colWidths[col], ' ', colWidths[col] - cellLength);
+        output[fieldEnd - 1] = col == cols - 1 ? '\n' : ' ';
+    }
+
+    free(cellEnds);
+    return (int) tableSize;
+}
+
+//Builds up a single line out of many formatted fragments. The output cursor and remaining capacity carry over
+//between appends, so each fragment starts where the last one ended without rescanning the buffer, and the null
+//terminator is written once by builderFinish rather than after every fragment.
+struct printBuilder {
+    char *output;
+    unsigned int pos;
+    size_t size;
+    int failed;
+};
+
+static void builderInit(struct printBuilder *b, char* output, size_t out_size) {
+    b->output = output;
+    b->pos = 0;
+    b->size = out_size;
+    b->failed = out_size == 0;
+}
+
+//Capacity available to fragments, keeping back one byte for the terminator.
+static size_t builderCapacity(struct printBuilder *b) {
+    return b->size ? b->size - 1 : 0;
+}
+
+//Appends a formatted fragment. A fragment that doesn't fit is cut short and fails the builder.
+static int builderAppendFormatArgs(struct printBuilder *b, const char* fmt, va_list args) {
+    size_t overflow = 0;
+    int ret;
+
+    if (b->failed) {
+        return -1;
+    }
+    ret = formatTokensMeasured(fmt, b->output, &b->pos, builderCapacity(b), args, &overflow);
+    if (ret < 0 || overflow) {
+        b->failed = 1;
+        return -1;
+    }
+    return ret;
+}
+
+static int builderAppendFormat(struct printBuilder *b, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = builderAppendFormatArgs(b, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+//Appends len bytes of data as-is. Returns -1 if they don't all fit.
+static int builderAppendRaw(struct printBuilder *b, const char* data, size_t len) {
+    size_t capacity = builderCapacity(b);
+
+    if (b->failed) {
+        return -1;
+    }
+    if (len > capacity - b->pos) {
+        len = capacity - b->pos;
+        b->failed = 1;
+    }
+    memcpy(b->output + b->pos, data, len);
+    b->pos += len;
+    return b->failed ? -1 : 0;
+}
+
+//Appends a null-terminated string without interpreting any '%' in it.
+static int builderAppendLiteral(struct printBuilder *b, const char* str) {
+    return builderAppendRaw(b, str, strlen(str));
+}
+
+//Null-terminates the output. Returns its length, or -1 if any append failed or was truncated.
+static int builderFinish(struct printBuilder *b) {
+    if (b->size == 0) {
+        return -1;
+    }
+    b->output[b->pos] = '\0';
+    return b->failed ? -1 : (int) b->pos;
+}
+
+//Backing memory for large capture and output buffers. Each option asks for something that cuts the cost of the
+//first burst into a fresh buffer, and falls back quietly if the system says no; allocated records what we got.
+//  BUFFER_HUGE_PAGES  MAP_HUGETLB with 2 MB pages, else transparent huge pages via madvise(MADV_HUGEPAGE)
+//  BUFFER_PREFAULT    MAP_POPULATE, else touching every page up front
+//  BUFFER_LOCK        mlock, so the pages stay resident
+#define BUFFER_HUGE_PAGES 1
+#define BUFFER_TRANSPARENT_HUGE_PAGES 2
+#define BUFFER_PREFAULT 4
+#define BUFFER_LOCK 8
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct bufferAllocation {
+    char *data;
+    size_t size;
+    size_t mappedSize;
+    unsigned int requested;
+    unsigned int allocated;
+};
+
+static int bufferAllocate(struct bufferAllocation *a, size_t size, unsigned int options) {
+    a->size = size;
+    a->requested = options;
+    a->allocated = 0;
+#if defined(__linux__)
+    //MAP_HUGETLB alone takes the system's default huge page size, which may be 1 GB, so ask for 2 MB pages.
+    const size_t hugePageSize = 2u << 20;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    void *data = MAP_FAILED;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    if (options & BUFFER_HUGE_PAGES) {
+        a->mappedSize = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+        data = mmap(NULL, a->mappedSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | 21 << MAP_HUGE_SHIFT
+                    | (options & BUFFER_PREFAULT ? MAP_POPULATE : 0), -1, 0);
+        if (data != MAP_FAILED) {
+            a->allocated |= BUFFER_HUGE_PAGES | (options & BUFFER_PREFAULT);
+        }
+    }
+#endif
+    if (data == MAP_FAILED) {
+        a->mappedSize = (size + pageSize - 1) / pageSize * pageSize;
+        data = mmap(NULL, a->mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            return -1;
+        }
+#if defined(MADV_HUGEPAGE)
+        //Has to come before the pages are touched for the kernel to back them with huge pages.
+        if ((options & BUFFER_HUGE_PAGES) && madvise(data, a->mappedSize, MADV_HUGEPAGE) == 0) {
+            a->allocated |= BUFFER_TRANSPARENT_HUGE_PAGES;
+        }
+#endif
+#if defined(MADV_POPULATE_WRITE)
+        if ((options & BUFFER_PREFAULT) && madvise(data, a->mappedSize, MADV_POPULATE_WRITE) == 0) {
+            a->allocated |= BUFFER_PREFAULT;
+        }
+#endif
+        if ((options & BUFFER_PREFAULT) && !(a->allocated & BUFFER_PREFAULT)) {
+            for (size_t offset = 0; offset < a->mappedSize; offset += pageSize) {
+                ((volatile char *) data)[offset] = 0;
+            }
+            a->allocated |= BUFFER_PREFAULT;
+        }
+    }
+    if ((options & BUFFER_LOCK) && mlock(data, a->mappedSize) == 0) {
+        a->allocated |= BUFFER_LOCK;
+    }
+    a->data = data;
+#else
+    a->mappedSize = size;
+    a->data = malloc(size);
+    if (!a->data) {
+        return -1;
+    }
+    if (options & BUFFER_PREFAULT) {
+        memset(a->data, 0, size);
+        a->allocated |= BUFFER_PREFAULT;
+    }
+#endif
+    return 0;
+}
+
+static void bufferRelease(struct bufferAllocation *a) {
+#if defined(__linux__)
+    if (a->allocated & BUFFER_LOCK) {
+        munlock(a->data, a->mappedSize);
+    }
+    munmap(a->data, a->mappedSize);
+#else
+    free(a->data);
+#endif
+    a->data = NULL;
+}
+
+//An output buffer shared between many producers, e.g. every work-item of a kernel.
+//Space is claimed with a single atomic add on the write offset, after which each producer fills in its own region
+//without any further synchronization. A reservation that runs past the end fails, and so do all later ones until
+//the buffer is flushed.
+struct sharedBuffer {
+    char *data;
+    size_t size;
+    atomic_size_t used;
+};
+
+//Longest record sharedPrintf formats in one go.
+#define SHARED_LINE_SIZE 256
+//Most text a single transaction can stage before committing.
+#define SHARED_TRANSACTION_SIZE 1024
+
+static void sharedBufferInit(struct sharedBuffer *buf, char* data, size_t size) {
+    buf->data = data;
+    buf->size = size;
+    atomic_init(&buf->used, 0);
+}
+
+//Reserves len contiguous bytes. Returns NULL if they don't fit.
+static char* sharedBufferReserve(struct sharedBuffer *buf, size_t len) {
+    size_t start = atomic_fetch_add_explicit(&buf->used, len, memory_order_relaxed);
+
+    if (start > buf->size || len > buf->size - start) {
+        PRINTF_PROBE3(reserve_failed, buf, len, start);
+        return NULL;
+    }
+    return buf->data + start;
+}
+
+//Writes out everything reserved so far and empties the buffer.
+//Only safe once every producer has finished writing into its reservations.
+static size_t sharedBufferFlush(struct sharedBuffer *buf, FILE* out) {
+    size_t used = atomic_load(&buf->used);
+
+    if (used > buf->size) {
+        used = buf->size;
+    }
+    TRACE_BEGIN("flush");
+    PRINTF_PROBE2(flush, buf, used);
+    fwrite(buf->data, 1, used, out);
+    atomic_store(&buf->used, 0);
+    TRACE_END("flush");
+    return used;
+}
+
+//Formats a single record and publishes it to the shared buffer with its own reservation. Records longer than
+//SHARED_LINE_SIZE aren't published.
+static int sharedPrintf(struct sharedBuffer *buf, const char* fmt, ...) {
+    char line[SHARED_LINE_SIZE];
+    unsigned int len = 0;
+    size_t overflow = 0;
+    char *dest;
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = formatTokensMeasured(fmt, line, &len, sizeof (line), args, &overflow);
+    va_end(args);
+    if (ret < 0 || overflow) {
+        return -1;
+    }
+
+    TRACE_BEGIN("publish");
+    dest = sharedBufferReserve(buf, len);
+    if (dest) {
+        memcpy(dest, line, len);
+    }
+    TRACE_END("publish");
+    return dest ? 0 : -1;
+}
+
+//A group of records staged locally and then published to a shared buffer with a single reservation, so that
+//the whole group appears contiguously no matter what other producers are doing.
+struct sharedTransaction {
+    struct sharedBuffer *buffer;
+    struct printBuilder staging;
+    char local[SHARED_TRANSACTION_SIZE];
+};
+
+static void sharedBegin(struct sharedTransaction *t, struct sharedBuffer *buf) {
+    t->buffer = buf;
+    builderInit(&t->staging, t->local, sizeof (t->local));
+}
+
+//Stages a record. A record that doesn't fit in the staging buffer fails the whole transaction.
+static int sharedAppend(struct sharedTransaction *t, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = builderAppendFormatArgs(&t->staging, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+//Publishes everything appended since sharedBegin. Nothing is published if any append failed or was cut short.
+static int sharedCommit(struct sharedTransaction *t) {
+    char *dest;
+
+    if (t->staging.failed) {
+        return -1;
+    }
+    TRACE_BEGIN("publish");
+    dest = sharedBufferReserve(t->buffer, t->staging.pos);
+    if (dest) {
+        memcpy(dest, t->local, t->staging.pos);
+    }
+    TRACE_END("publish");
+    return dest ? 0 : -1;
+}
+
+//Streaming output for large sinks that this core won't read again, such as bulk decoding into a big buffer. Each
+//line is rendered into a small buffer that stays in cache, and the sink is written in whole 64-byte lines with
+//non-temporal stores, so the output doesn't push the engine's own tables out of cache. streamCommit writes the
+//partial last line and fences. Off x86-64, or if data isn't 64-byte aligned, lines are copied normally.
+#define STREAM_LINE_SIZE 64
+
+struct streamSink {
+    char *data;
+    size_t size;
+    size_t used;
+    int streaming;
+    unsigned int lineFill;
+    _Alignas(STREAM_LINE_SIZE) char line[STREAM_LINE_SIZE];
+};
+
+static void streamSinkInit(struct streamSink *s, char* data, size_t size) {
+    s->data = data;
+    s->size = size;
+    s->used = 0;
+    s->lineFill = 0;
+#if defined(__x86_64__)
+    s->streaming = ((uintptr_t) data % STREAM_LINE_SIZE) == 0;
+#else
+    s->streaming = 0;
+#endif
+}
+
+static void streamWriteLine(struct streamSink *s) {
+    char *dest = s->data + s->used;
+
+#if defined(__x86_64__)
+    if (s->streaming) {
+        const __m128i *src = (const __m128i *) s->line;
+        _mm_stream_si128((__m128i *) dest, _mm_load_si128(src));
+        _mm_stream_si128((__m128i *) dest + 1, _mm_load_si128(src + 1));
+        _mm_stream_si128((__m128i *) dest + 2, _mm_load_si128(src + 2));
+        _mm_stream_si128((__m128i *) dest + 3, _mm_load_si128(src + 3));
+    } else
+#endif
+    {
+        memcpy(dest, s->line, STREAM_LINE_SIZE);
+    }
+    s->used += STREAM_LINE_SIZE;
+    s->lineFill = 0;
+}
+
+//Appends bytes to the sink. Returns -1 if they don't all fit, leaving the sink unchanged.
+static int streamAppend(struct streamSink *s, const char* bytes, size_t len) {
+    if (len > s->size - s->used - s->lineFill) {
+        return -1;
+    }
+    while (len) {
+        size_t n = STREAM_LINE_SIZE - s->lineFill < len ? STREAM_LINE_SIZE - s->lineFill : len;
+        memcpy(s->line + s->lineFill, bytes, n);
+        s->lineFill += n;
+        bytes += n;
+        len -= n;
+        if (s->lineFill == STREAM_LINE_SIZE) {
+            streamWriteLine(s);
+        }
+    }
+    return 0;
+}
+
+//Lines longer than SHARED_LINE_SIZE are rendered a second time, into a buffer from the heap.
+static int streamPrintf(struct streamSink *s, const char* fmt, ...) {
+    char line[SHARED_LINE_SIZE];
+    char *longLine = NULL;
+    unsigned int len = 0;
+    size_t overflow = 0;
+    va_list args, retry;
+    int ret;
+
+    va_start(args, fmt);
+    va_copy(retry, args);
+    ret = formatTokensMeasured(fmt, line, &len, sizeof (line), args, &overflow);
+    if (ret >= 0 && overflow) {
+        size_t size = len + overflow;
+        len = 0;
+        ret = (longLine = malloc(size)) ? formatTokens(fmt, longLine, &len, size, retry) : -1;
+    }
+    va_end(retry);
+    va_end(args);
+    if (ret >= 0) {
+        ret = streamAppend(s, longLine ? longLine : line, len);
+    }
+    free(longLine);
+    return ret;
+}
+
+//Decodes a compiled format's argument block into the sink.
+static int streamFormatBlock(struct streamSink *s, const struct compiledFormat *cf, const union printArgument *argBlock) {
+    char line[SHARED_LINE_SIZE];
+    char *longLine = NULL;
+    unsigned int len = 0;
+    size_t overflow = 0;
+    int ret = formatArgBlockMeasured(cf, line, &len, sizeof (line), argBlock, &overflow);
+
+    if (ret >= 0 && overflow) {
+        size_t size = len + overflow;
+        len = 0;
+        ret = (longLine = malloc(size)) ? formatArgBlock(cf, longLine, &len, size, argBlock) : -1;
+    }
+    if (ret >= 0) {
+        ret = streamAppend(s, longLine ? longLine : line, len);
+    }
+    free(longLine);
+    return ret;
+}
+
+//Writes out the partial last line and makes the streamed lines visible to other cores. Returns the number of bytes
+//in the sink.
+static size_t streamCommit(struct streamSink *s) {
+    memcpy(s->data + s->used, s->line, s->lineFill);
+#if defined(__x86_64__)
+    _mm_sfence();
+#endif
+    return s->used + s->lineFill;
+}
+
+#define MAX_TEMPLATE_SIZE 256
+
+//A conversion of a template, occupying width bytes of the rendered layout starting at offset.
+struct templateField {
+    unsigned int offset;
+    unsigned int width;
+    unsigned int base;
+    int isSigned;
+    int zeroPad;
+    int upperCase;
+    const struct formatSegment *seg;
+};
+
+//A format where every conversion is a fixed-width integer (e.g. "%08x %08x %5d\n"), so the output always has the
+//same layout. The layout is rendered once, literals and padding included, and printing just copies it and patches
+//the digits of each field in place. Values too wide for their field fall back to full formatting.
+struct printTemplate {
+    struct compiledFormat cf;
+    unsigned int length;
+    unsigned int numFields;
+    struct templateField fields[MAX_FORMAT_SEGMENTS];
+    char rendered[MAX_TEMPLATE_SIZE];
+};
+
+//Returns 0 on success, or -1 if fmt doesn't have a fixed layout.
+static int compileTemplate(struct printTemplate *t, const char* fmt) {
+    t->length = 0;
+    t->numFields = 0;
+    if (compileFormat(&t->cf, fmt) < 0) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < t->cf.numSegments; i++) {
+        const struct formatSegment *seg = &t->cf.segments[i];
+        struct templateField *field;
+
+        if (t->length + seg->literalLength > MAX_TEMPLATE_SIZE) {
+            return -1;
+        }
+        memcpy(t->rendered + t->length, fmt + seg->literalStart, seg->literalLength);
+        t->length += seg->literalLength;
+        if (!seg->spec) {
+            continue;
+        }
+
+        //Only '0' changes the layout in a way we can render up front.
+        if (seg->widthArg >= 0 || seg->precisionArg >= 0 || seg->ps.width <= 0 || seg->ps.precision >= 0
+            || seg->ps.f.leftJustify || seg->ps.f.forcePlusMinus || seg->ps.f.spacePrefixPositiveNumber
+            || seg->ps.f.zeroPrefixedOrForceDecimal || t->length + seg->ps.width > MAX_TEMPLATE_SIZE) {
+            return -1;
+        }
+        field = &t->fields[t->numFields++];
+        field->offset = t->length;
+        field->width = seg->ps.width;
+        field->zeroPad = seg->ps.f.leftPadWithZeroes;
+        field->upperCase = seg->spec == 'X';
+        field->isSigned = 0;
+        field->seg = seg;
+        switch (seg->spec) {
+            case 'd': case 'i': field->isSigned = 1; field->base = 10; break;
+            case 'u': field->base = 10; break;
+            case 'o': field->base = 8; break;
+            case 'x': case 'X': field->base = 16; break;
+            default: return -1;
+        }
+        memset(t->rendered + t->length, field->zeroPad ? '0' : ' ', field->width);
+        t->length += field->width;
+    }
+    return 0;
+}
+
+//Writes the digits of value right-aligned into the field, over the padding already in place.
+//Returns 0, or -1 if the value doesn't fit in the field width.
+static int patchTemplateField(const struct templateField *field, char* region, union printArgument arg) {
+    struct printSpecification *ps = (struct printSpecification *) &field->seg->ps;
+    const char *digits = field->upperCase ? "0123456789ABCDEF" : "0123456789abcdef";
+    unsigned long magnitude;
+    int negative = 0;
+    int pos = field->width;
+
+    if (field->isSigned) {
+        long value = wrapSignedValueToSize(ps, arg.i);
+        negative = value < 0;
+        magnitude = negative ? 0 - (unsigned long) value : (unsigned long) value;
+    } else {
+        magnitude = wrapValueToSize(ps, arg.u);
+    }
+
+    do {
+        if (pos == negative) {
+            return -1;
+        }
+        region[--pos] = digits[magnitude % field->base];
+        magnitude /= field->base;
+    } while (magnitude != 0);
+
+    if (negative) {
+        region[field->zeroPad ? 0 : pos - 1] = '-';
+    }
+    return 0;
+}
+
+//Like myPrintf, returns the length the whole output would have had.
+static int printTemplate(const struct printTemplate *t, char* output, size_t out_size, ...) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    va_start(args, out_size);
+    ret = readArgBlock(&t->cf, argBlock, args);
+    va_end(args);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (t->length <= space) {
+        memcpy(output, t->rendered, t->length);
+        for (unsigned int i = 0; i < t->numFields && ret == 0; i++) {
+            const struct templateField *field = &t->fields[i];
+            ret = patchTemplateField(field, output + field->offset, argBlock[field->seg->valueArg]);
+        }
+        if (ret == 0) {
+            output[t->length] = '\0';
+            return t->length;
+        }
+    }
+
+    //Doesn't fit the fixed layout, format it the long way.
+    ret = formatArgBlockMeasured(&t->cf, output, &outPos, space, argBlock, &overflow);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Specialized emitters an adaptive format can pick between for each conversion, based on the values it has seen.
+typedef enum EMITTER {
+    EMITTER_GENERIC,
+    EMITTER_SMALL_INT,       //plain %d/%i/%u of 1-4 digits
+    EMITTER_INTEGRAL_DOUBLE, //plain %f/%F of a whole number
+    NUM_EMITTERS
+} emitter;
+
+static const char* emitterNames[NUM_EMITTERS] = {"generic", "small-int", "integral-double"};
+
+//Calls spent watching every value on the generic path before picking emitters.
+#define ADAPTIVE_WARMUP_CALLS 64
+//How often the chosen emitters are checked against the values they had to hand back to the generic path.
+#define ADAPTIVE_RECHECK_CALLS 1024
+//More misses than this per recheck window and the format goes back to warming up.
+#define ADAPTIVE_MAX_MISSES (ADAPTIVE_RECHECK_CALLS / 16)
+
+struct adaptiveSegment {
+    emitter variant;
+    unsigned int fits[NUM_EMITTERS];
+    unsigned int misses;
+};
+
+//A compiled format that keeps statistics on its arguments and, after a warm-up window, switches each conversion
+//to the cheapest emitter that can handle the values it sees. Values an emitter can't handle still go through the
+//generic path, and if that starts happening too often the format warms up again.
+struct adaptiveFormat {
+    struct compiledFormat cf;
+    unsigned int calls;
+    struct adaptiveSegment segs[MAX_FORMAT_SEGMENTS];
+};
+
+static int compileAdaptive(struct adaptiveFormat *af, const char* fmt) {
+    memset(af->segs, 0, sizeof (af->segs));
+    af->calls = 0;
+    return compileFormat(&af->cf, fmt);
+}
+
+static int isPlainConversion(const struct formatSegment *seg) {
+    return seg->widthArg < 0 && seg->precisionArg < 0 && seg->ps.width <= 0
+        && !seg->ps.f.leftJustify && !seg->ps.f.forcePlusMinus && !seg->ps.f.spacePrefixPositiveNumber
+        && !seg->ps.f.zeroPrefixedOrForceDecimal && !seg->ps.f.leftPadWithZeroes;
+}
+
+//Emits a plain %d/%i/%u whose value has at most 4 digits. Returns 0 if the value (or the output space) doesn't fit.
+static int emitSmallInt(const struct formatSegment *seg, char* output, unsigned int *outPos, size_t out_size, union printArgument arg) {
+    struct printSpecification *ps = (struct printSpecification *) &seg->ps;
+    unsigned long magnitude;
+    char *out = output + *outPos;
+    int negative = 0;
+    int digits;
+
+    if ((seg->spec != 'd' && seg->spec != 'i' && seg->spec != 'u') || ps->precision >= 0 || !isPlainConversion(seg)) {
+        return 0;
+    }
+    if (seg->spec == 'u') {
+        magnitude = wrapValueToSize(ps, arg.u);
+    } else {
+        long value = wrapSignedValueToSize(ps, arg.i);
+        negative = value < 0;
+        magnitude = negative ? 0 - (unsigned long) value : (unsigned long) value;
+    }
+    if (magnitude > 9999 || out_size - *outPos < 5) {
+        return 0;
+    }
+
+    digits = magnitude >= 1000 ? 4 : magnitude >= 100 ? 3 : magnitude >= 10 ? 2 : 1;
+    if (negative) {
+        *out++ = '-';
+    }
+    for (int i = digits - 1; i >= 0; i--) {
+        out[i] = '0' + magnitude % 10;
+        magnitude /= 10;
+    }
+    *outPos += negative + digits;
+    return 1;
+}
+
+//Emits a plain %f/%F whose value is a whole number below 1e15. Returns 0 if the value (or the output space) doesn't fit.
+static int emitIntegralDouble(const struct formatSegment *seg, char* output, unsigned int *outPos, size_t out_size, union printArgument arg) {
+    int precision = seg->ps.precision < 0 ? 6 : seg->ps.precision;
+    double magnitude = fabs(arg.d);
+    unsigned long intValue;
+    unsigned int startPos;
+
+    if ((seg->spec != 'f' && seg->spec != 'F') || precision > 20 || !isPlainConversion(seg)) {
+        return 0;
+    }
+    if (!(magnitude < 1e15) || magnitude != trunc(magnitude) || out_size - *outPos < 18 + precision) {
+        return 0;
+    }
+
+    if (signbit(arg.d)) {
+        output[(*outPos)++] = '-';
+    }
+    intValue = (unsigned long) magnitude;
+    startPos = *outPos;
+    do {
+        output[(*outPos)++] = '0' + intValue % 10;
+        intValue /= 10;
+    } while (intValue != 0);
+    reverseString(output, outPos, startPos);
+
+    if (precision > 0) {
+        output[(*outPos)++] = '.';
+        memset(output + *outPos, '0', precision);
+        *outPos += precision;
+    }
+    return 1;
+}
+
+static int runEmitter(emitter variant, const struct formatSegment *seg, char* output, unsigned int *outPos, size_t out_size, union printArgument arg) {
+    switch (variant) {
+        case EMITTER_SMALL_INT:
+            return emitSmallInt(seg, output, outPos, out_size, arg);
+        case EMITTER_INTEGRAL_DOUBLE:
+            return emitIntegralDouble(seg, output, outPos, out_size, arg);
+        default:
+            return 0;
+    }
+}
+
+//Would the given emitter have handled this value? Only used while warming up, so it's fine to just try it out
+//on a scratch buffer.
+static int emitterFits(emitter variant, const struct formatSegment *seg, union printArgument arg) {
+    char scratch[64];
+    unsigned int pos = 0;
+    return runEmitter(variant, seg, scratch, &pos, sizeof (scratch), arg);
+}
+
+static void adaptiveUpdate(struct adaptiveFormat *af) {
+    af->calls++;
+    if (af->calls == ADAPTIVE_WARMUP_CALLS) {
+        //Pick the first emitter that handled every value seen during warm-up.
+        for (unsigned int i = 0; i < af->cf.numSegments; i++) {
+            struct adaptiveSegment *as = &af->segs[i];
+            as->variant = EMITTER_GENERIC;
+            for (int v = EMITTER_GENERIC + 1; v < NUM_EMITTERS; v++) {
+                if (as->fits[v] == ADAPTIVE_WARMUP_CALLS) {
+                    as->variant = v;
+                    break;
+                }
+            }
+            as->misses = 0;
+        }
+    } else if (af->calls > ADAPTIVE_WARMUP_CALLS && (af->calls - ADAPTIVE_WARMUP_CALLS) % ADAPTIVE_RECHECK_CALLS == 0) {
+        int rewarm = 0;
+        for (unsigned int i = 0; i < af->cf.numSegments; i++) {
+            rewarm |= af->segs[i].misses > ADAPTIVE_MAX_MISSES;
+            af->segs[i].misses = 0;
+        }
+        if (rewarm) {
+            memset(af->segs, 0, sizeof (af->segs));
+            af->calls = 0;
+        }
+    }
+}
+
+//Like myPrintf, returns the length the whole output would have had.
+static int printAdaptive(struct adaptiveFormat *af, char* output, size_t out_size, ...) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    const struct compiledFormat *cf = &af->cf;
+    int warmingUp = af->calls < ADAPTIVE_WARMUP_CALLS;
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    va_start(args, out_size);
+    ret = readArgBlock(cf, argBlock, args);
+    va_end(args);
+    if (ret < 0) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < cf->numSegments; i++) {
+        const struct formatSegment *seg = &cf->segments[i];
+        struct adaptiveSegment *as = &af->segs[i];
+        struct printSpecification ps;
+        unsigned int literalLength = seg->literalLength;
+
+        if (literalLength > space - outPos) {
+            literalLength = space - outPos;
+            overflow += seg->literalLength - literalLength;
+        }
+        memcpy(output + outPos, cf->fmt + seg->literalStart, literalLength);
+        outPos += literalLength;
+
+        if (!seg->spec) {
+            continue;
+        }
+        if (warmingUp) {
+            for (int v = EMITTER_GENERIC + 1; v < NUM_EMITTERS; v++) {
+                as->fits[v] += emitterFits(v, seg, argBlock[seg->valueArg]);
+            }
+        } else if (as->variant != EMITTER_GENERIC && outPos < space) {
+            if (runEmitter(as->variant, seg, output, &outPos, space, argBlock[seg->valueArg])) {
+                continue;
+            }
+            as->misses++;
+        }
+
+        ps = seg->ps;
+        if (seg->widthArg >= 0) {
+            ps.width = (int) argBlock[seg->widthArg].i;
+        }
+        if (seg->precisionArg >= 0) {
+            ps.precision = (int) argBlock[seg->precisionArg].i;
+        }
+        if (printArgumentMeasured(&ps, output, &outPos, space, seg->spec, argBlock[seg->valueArg], &overflow) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    terminateOutput(output, outPos, out_size);
+    adaptiveUpdate(af);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//State shared between printJit and the machine code it runs. The generated code relies on the offsets of
+//output, pos and size, so keep those three first.
+struct jitContext {
+    char *output;
+    unsigned long pos;
+    unsigned long size;
+    const union printArgument *argBlock;
+};
+
+//Returned by generated code that ran out of output space. printJit redoes the whole format on the interpreter,
+//which takes care of truncating and measuring exactly like printCompiled would.
+#define JIT_BAIL -2
+
+//A compiled format turned into straight-line machine code: literals become immediate stores and each
+//conversion a direct call into the converter for its emitter with its segment (and so its width and flags) baked
+//in. The code points into cf, so a jitFormat can't be moved once compiled. Only available on x86-64 Linux;
+//elsewhere, or if the code page can't be mapped, code is NULL and printJit runs the interpreter instead.
+struct jitFormat {
+    struct compiledFormat cf;
+    int (*code)(struct jitContext *ctx);
+    size_t codeSize;
+};
+
+//The conversion's specification with any '*' width and precision filled in. Returns 0 if there's no room left.
+static int jitSpecification(const struct jitContext *ctx, const struct formatSegment *seg, struct printSpecification *ps) {
+    if (ctx->pos >= ctx->size) {
+        return 0;
+    }
+    *ps = seg->ps;
+    if (seg->widthArg >= 0) {
+        ps->width = (int) ctx->argBlock[seg->widthArg].i;
+    }
+    if (seg->precisionArg >= 0) {
+        ps->precision = (int) ctx->argBlock[seg->precisionArg].i;
+    }
+    limitSpecification(ps);
+    return 1;
+}
+
+//Called from generated code for each conversion, one per emitter so that the generated code calls straight into
+//the emitter for its specifier instead of going through printArgument's switch.
+#define JIT_CONVERTER(name, specValue, emitter, argField) \
+static int name(struct jitContext *ctx, const struct formatSegment *seg) { \
+    struct printSpecification ps; \
+    unsigned int pos = ctx->pos; \
+    if (!jitSpecification(ctx, seg, &ps)) { \
+        return JIT_BAIL; \
+    } \
+    ps.s = specValue; \
+    if (emitter(&ps, ctx->output, &pos, ctx->size, ctx->argBlock[seg->valueArg].argField) < 0 || pos >= ctx->size) { \
+        /*Possibly cut short, so let the interpreter measure it.*/ \
+        return JIT_BAIL; \
+    } \
+    ctx->pos = pos; \
+    return 0; \
+}
+
+JIT_CONVERTER(jitConvertLong, SPEC_D, printLong, i)
+JIT_CONVERTER(jitConvertUnsigned, SPEC_U, printUnsignedLong, u)
+JIT_CONVERTER(jitConvertOctal, SPEC_O, printOctal, u)
+JIT_CONVERTER(jitConvertLowerHex, SPEC_LOWER_X, printHex, u)
+JIT_CONVERTER(jitConvertUpperHex, SPEC_UPPER_X, printHex, u)
+JIT_CONVERTER(jitConvertLowerFloat, SPEC_LOWER_F, printFloat, d)
+JIT_CONVERTER(jitConvertUpperFloat, SPEC_UPPER_F, printFloat, d)
+JIT_CONVERTER(jitConvertLowerScientific, SPEC_LOWER_E, printScientific, d)
+JIT_CONVERTER(jitConvertUpperScientific, SPEC_UPPER_E, printScientific, d)
+JIT_CONVERTER(jitConvertLowerShortest, SPEC_LOWER_G, printShortestFloat, d)
+JIT_CONVERTER(jitConvertUpperShortest, SPEC_UPPER_G, printShortestFloat, d)
+JIT_CONVERTER(jitConvertString, SPEC_S, printString, s)
+
+static int jitConvertChar(struct jitContext *ctx, const struct formatSegment *seg) {
+    unsigned int pos = ctx->pos;
+    if (!printChar(ctx->output, (int) ctx->argBlock[seg->valueArg].i, &pos, ctx->size) || pos >= ctx->size) {
+        return JIT_BAIL;
+    }
+    ctx->pos = pos;
+    return 0;
+}
+
+typedef int (*jitConverter)(struct jitContext *ctx, const struct formatSegment *seg);
+
+static jitConverter jitConverterFor(char spec) {
+    switch (spec) {
+        case 'd':
+        case 'i': return jitConvertLong;
+        case 'u': return jitConvertUnsigned;
+        case 'o': return jitConvertOctal;
+        case 'x': return jitConvertLowerHex;
+        case 'X': return jitConvertUpperHex;
+        case 'f': return jitConvertLowerFloat;
+        case 'F': return jitConvertUpperFloat;
+        case 'e': return jitConvertLowerScientific;
+        case 'E': return jitConvertUpperScientific;
+        case 'g': return jitConvertLowerShortest;
+        case 'G': return jitConvertUpperShortest;
+        case 's': return jitConvertString;
+        case 'c': return jitConvertChar;
+        default: return NULL;
+    }
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+
+static unsigned char* jitEmit(unsigned char* code, const void* bytes, size_t len) {
+    memcpy(code, bytes, len);
+    return code + len;
+}
+
+static unsigned char* jitEmit32(unsigned char* code, unsigned int value) {
+    return jitEmit(code, &value, 4);
+}
+
+static unsigned char* jitEmit64(unsigned char* code, unsigned long value) {
+    return jitEmit(code, &value, 8);
+}
+
+//Emits a jump with a 32-bit displacement to be patched once the bail-out label is known.
+static unsigned char* jitEmitBailJump(unsigned char* code, const unsigned char* opcode, unsigned char** fixups, unsigned int *numFixups) {
+    code = jitEmit(code, opcode, 2);
+    fixups[(*numFixups)++] = code;
+    return jitEmit32(code, 0);
+}
+
+static int jitCompile(struct jitFormat *jf, const char* fmt) {
+    static const unsigned char JA[] = {0x0f, 0x87}, JNZ[] = {0x0f, 0x85};
+    unsigned char *bailFixups[MAX_FORMAT_SEGMENTS], *doneFixups[MAX_FORMAT_SEGMENTS];
+    unsigned int numBailFixups = 0, numDoneFixups = 0;
+    unsigned char *code, *start, *done, *bail;
+    size_t literalBytes = 0;
+
+    jf->code = NULL;
+    if (compileFormat(&jf->cf, fmt) < 0) {
+        return -1;
+    }
+
+    //Generously sized: every literal byte costs at most 3 code bytes plus a fixed amount per segment.
+    for (unsigned int i = 0; i < jf->cf.numSegments; i++) {
+        literalBytes += jf->cf.segments[i].literalLength;
+    }
+    jf->codeSize = 64 + jf->cf.numSegments * 96 + literalBytes * 3;
+    start = mmap(NULL, jf->codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        return 0;
+    }
+
+    //push rbx; mov rbx, rdi
+    code = jitEmit(start, "\x53\x48\x89\xfb", 4);
+    for (unsigned int i = 0; i < jf->cf.numSegments; i++) {
+        const struct formatSegment *seg = &jf->cf.segments[i];
+        const char *literal = fmt + seg->literalStart;
+        unsigned int len = seg->literalLength;
+
+        if (len) {
+            unsigned int off = 0;
+            //mov rax, [rbx+pos]; lea rdx, [rax+len]; cmp rdx, [rbx+size]; ja bail; add rax, [rbx+output]
+            code = jitEmit(code, "\x48\x8b\x43\x08\x48\x8d\x90", 7);
+            code = jitEmit32(code, len);
+            code = jitEmit(code, "\x48\x3b\x53\x10", 4);
+            code = jitEmitBailJump(code, JA, bailFixups, &numBailFixups);
+            code = jitEmit(code, "\x48\x03\x03", 3);
+            for (; len - off >= 8; off += 8) {
+                //mov rcx, imm64; mov [rax+off], rcx
+                unsigned long chunk;
+                memcpy(&chunk, literal + off, 8);
+                code = jitEmit(code, "\x48\xb9", 2);
+                code = jitEmit64(code, chunk);
+                code = jitEmit(code, "\x48\x89\x88", 3);
+                code = jitEmit32(code, off);
+            }
+            if (len - off >= 4) {
+                //mov dword [rax+off], imm32
+                code = jitEmit(code, "\xc7\x80", 2);
+                code = jitEmit32(code, off);
+                code = jitEmit(code, literal + off, 4);
+                off += 4;
+            }
+            if (len - off >= 2) {
+                //mov word [rax+off], imm16
+                code = jitEmit(code, "\x66\xc7\x80", 3);
+                code = jitEmit32(code, off);
+                code = jitEmit(code, literal + off, 2);
+                off += 2;
+            }
+            if (len - off == 1) {
+                //mov byte [rax+off], imm8
+                code = jitEmit(code, "\xc6\x80", 2);
+                code = jitEmit32(code, off);
+                code = jitEmit(code, literal + off, 1);
+            }
+            //mov [rbx+pos], rdx
+            code = jitEmit(code, "\x48\x89\x53\x08", 4);
+        }
+
+        if (seg->spec) {
+            jitConverter converter = jitConverterFor(seg->spec);
+            if (!converter) {
+                munmap(start, jf->codeSize);
+                return 0;
+            }
+            //mov rdi, rbx; mov rsi, seg; mov rax, converter; call rax; test eax, eax; jnz done
+            code = jitEmit(code, "\x48\x89\xdf\x48\xbe", 5);
+            code = jitEmit64(code, (unsigned long) seg);
+            code = jitEmit(code, "\x48\xb8", 2);
+            code = jitEmit64(code, (unsigned long) converter);
+            code = jitEmit(code, "\xff\xd0\x85\xc0", 4);
+            code = jitEmitBailJump(code, JNZ, doneFixups, &numDoneFixups);
+        }
+    }
+    //xor eax, eax; done: pop rbx; ret; bail: mov eax, JIT_BAIL; pop rbx; ret
+    code = jitEmit(code, "\x31\xc0", 2);
+    done = code;
+    code = jitEmit(code, "\x5b\xc3\xb8", 3);
+    bail = code - 1;
+    code = jitEmit32(code, (unsigned int) JIT_BAIL);
+    code = jitEmit(code, "\x5b\xc3", 2);
+
+    for (unsigned int i = 0; i < numBailFixups; i++) {
+        int rel = (int) (bail - (bailFixups[i] + 4));
+        memcpy(bailFixups[i], &rel, 4);
+    }
+    for (unsigned int i = 0; i < numDoneFixups; i++) {
+        int rel = (int) (done - (doneFixups[i] + 4));
+        memcpy(doneFixups[i], &rel, 4);
+    }
+
+    if (mprotect(start, jf->codeSize, PROT_READ | PROT_EXEC) < 0) {
+        munmap(start, jf->codeSize);
+        return 0;
+    }
+    jf->code = (int (*)(struct jitContext *)) start;
+    return 0;
+}
+
+static void jitFree(struct jitFormat *jf) {
+    if (jf->code) {
+        munmap((void *) jf->code, jf->codeSize);
+        jf->code = NULL;
+    }
+}
+#else
+static int jitCompile(struct jitFormat *jf, const char* fmt) {
+    jf->code = NULL;
+    return compileFormat(&jf->cf, fmt);
+}
+
+static void jitFree(struct jitFormat *jf) {
+}
+#endif
+
+//Like myPrintf, returns the length the whole output would have had.
+static int printJit(const struct jitFormat *jf, char* output, size_t out_size, ...) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    va_start(args, out_size);
+    ret = readArgBlock(&jf->cf, argBlock, args);
+    va_end(args);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (jf->code) {
+        struct jitContext ctx = {output, 0, space, argBlock};
+        if (jf->code(&ctx) != JIT_BAIL) {
+            terminateOutput(output, ctx.pos, out_size);
+            return (int) ctx.pos;
+        }
+    }
+    ret = formatArgBlockMeasured(&jf->cf, output, &outPos, space, argBlock, &overflow);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Captures: printf calls recorded as (timestamp, format ID, packed arguments) for formatting later, e.g. on the
+//host. A capture file is the magic string followed by a stream of entries. Each format string is defined by an
+//entry with CAPTURE_DEFINE_FORMAT set in its format ID, before the first record that uses it. Record payloads hold
+//the format's arguments in argument block order: 8 bytes each for numbers, and for strings a 4-byte length followed
+//by that many bytes including the terminator. Everything is in host byte order.
+#define CAPTURE_MAGIC "PFCAP1\n"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_DEFINE_FORMAT 0x80000000u
+#define CAPTURE_MAX_FORMATS 1024
+#define CAPTURE_FORMAT_SLOTS (2 * CAPTURE_MAX_FORMATS)
+#define CAPTURE_MAX_PAYLOAD 4096
+
+struct captureEntry {
+    uint64_t timestamp;
+    uint32_t formatId;
+    uint32_t rank;
+    uint32_t payloadLength;
+    uint32_t reserved;
+};
+
+struct captureFormatSlot {
+    const char *fmt;
+    unsigned int id;
+};
+
+struct captureWriter {
+    FILE *file;
+    uint32_t rank;
+    unsigned int numFormats;
+    struct compiledFormat *compiled[CAPTURE_MAX_FORMATS];
+    //Format IDs keyed by the format string's address, since call sites pass the same literal every time. With
+    //keyByContent they're keyed by the string itself, and the slots own copies, for callers that can't promise
+    //their formats stay put.
+    int keyByContent;
+    struct captureFormatSlot slots[CAPTURE_FORMAT_SLOTS];
+};
+
+struct captureReader {
+    FILE *file;
+    unsigned int numFormats;
+    char *formats[CAPTURE_MAX_FORMATS];
+    struct compiledFormat *compiled[CAPTURE_MAX_FORMATS];
+    //The record captureNext last read.
+    struct captureEntry entry;
+    char payload[CAPTURE_MAX_PAYLOAD];
+};
+
+//Nanoseconds on the monotonic clock, which every process on the host shares, so it orders records across
+//processes. The coarse clock is a few ns to read, at the cost of only ticking every few ms.
+static uint64_t monotonicNanoseconds(int coarse) {
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned int captureHash(const void* key, size_t len) {
+    const unsigned char *bytes = key;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int captureWriteEntry(FILE* file, uint64_t timestamp, uint32_t formatId, uint32_t rank, const void* payload, uint32_t payloadLength) {
+    struct captureEntry entry = {timestamp, formatId, rank, payloadLength, 0};
+
+    if (fwrite(&entry, sizeof (entry), 1, file) != 1 || fwrite(payload, 1, payloadLength, file) != payloadLength) {
+        return -1;
+    }
+    return 0;
+}
+
+static int captureWriteMagic(FILE* file) {
+    return fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE, 1, file) == 1 ? 0 : -1;
+}
+
+static int captureWriterOpen(struct captureWriter *w, FILE* file, uint32_t rank) {
+    w->file = file;
+    w->rank = rank;
+    w->numFormats = 0;
+    w->keyByContent = 0;
+    memset(w->slots, 0, sizeof (w->slots));
+    return captureWriteMagic(file);
+}
+
+//Returns the capture's ID for fmt, defining it in the capture the first time it's seen, or -1 on failure.
+static int captureFormatId(struct captureWriter *w, const char* fmt) {
+    size_t length = strlen(fmt);
+    unsigned int slot = (w->keyByContent ? captureHash(fmt, length) : captureHash(&fmt, sizeof (fmt))) % CAPTURE_FORMAT_SLOTS;
+    struct compiledFormat *cf;
+    char *copy = NULL;
+
+    while (w->slots[slot].fmt) {
+        if (w->slots[slot].fmt == fmt || (w->keyByContent && !strcmp(w->slots[slot].fmt, fmt))) {
+            return w->slots[slot].id;
+        }
+        slot = (slot + 1) % CAPTURE_FORMAT_SLOTS;
+    }
+
+    if (w->numFormats == CAPTURE_MAX_FORMATS || length > CAPTURE_MAX_PAYLOAD || !(cf = malloc(sizeof (*cf)))) {
+        return -1;
+    }
+    if ((w->keyByContent && !(copy = malloc(length + 1))) || compileFormat(cf, fmt) < 0
+        || captureWriteEntry(w->file, 0, CAPTURE_DEFINE_FORMAT | w->numFormats, w->rank, fmt, length) < 0) {
+        free(copy);
+        free(cf);
+        return -1;
+    }
+    if (copy) {
+        fmt = memcpy(copy, fmt, length + 1);
+    }
+    w->compiled[w->numFormats] = cf;
+    w->slots[slot].fmt = fmt;
+    w->slots[slot].id = w->numFormats;
+    return w->numFormats++;
+}
+
+//Packs an argument block into a record payload. Returns the payload length, or -1 if it doesn't fit.
+static int capturePackArgs(const struct compiledFormat *cf, const union printArgument *argBlock, char* payload) {
+    unsigned int len = 0;
+
+    for (unsigned int i = 0; i < cf->numArgs; i++) {
+        if (cf->argTypes[i] == ARG_STRING) {
+            uint32_t stringLength = strlen(argBlock[i].s) + 1;
+            if (len + 4 + stringLength > CAPTURE_MAX_PAYLOAD) {
+                return -1;
+            }
+            memcpy(payload + len, &stringLength, 4);
+            memcpy(payload + len + 4, argBlock[i].s, stringLength);
+            len += 4 + stringLength;
+        } else {
+            if (len + 8 > CAPTURE_MAX_PAYLOAD) {
+                return -1;
+            }
+            memcpy(payload + len, &argBlock[i], 8);
+            len += 8;
+        }
+    }
+    return len;
+}
+
+//Unpacks a record payload into an argument block. Strings point into the payload.
+static int captureUnpackArgs(const struct compiledFormat *cf, union printArgument *argBlock, char* payload, uint32_t payloadLength) {
+    uint32_t len = 0;
+
+    for (unsigned int i = 0; i < cf->numArgs; i++) {
+        if (cf->argTypes[i] == ARG_STRING) {
+            uint32_t stringLength;
+            if (len + 4 > payloadLength) {
+                return -1;
+            }
+            memcpy(&stringLength, payload + len, 4);
+            if (stringLength == 0 || stringLength > payloadLength - len - 4 || payload[len + 4 + stringLength - 1]) {
+                return -1;
+            }
+            argBlock[i].s = payload + len + 4;
+            len += 4 + stringLength;
+        } else {
+            if (len + 8 > payloadLength) {
+                return -1;
+            }
+            memcpy(&argBlock[i], payload + len, 8);
+            len += 8;
+        }
+    }
+    return 0;
+}
+
+//Records a printf call. Unless the writer keys formats by content, the format string must stay at the same address
+//for the life of the writer.
+static int captureRecordArgs(struct captureWriter *w, uint64_t timestamp, const char* fmt, va_list args) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    char payload[CAPTURE_MAX_PAYLOAD];
+    int id = captureFormatId(w, fmt);
+    int payloadLength;
+
+    if (id < 0 || readArgBlock(w->compiled[id], argBlock, args) < 0
+        || (payloadLength = capturePackArgs(w->compiled[id], argBlock, payload)) < 0) {
+        return -1;
+    }
+    return captureWriteEntry(w->file, timestamp, id, w->rank, payload, payloadLength);
+}
+
+static int captureRecord(struct captureWriter *w, uint64_t timestamp, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = captureRecordArgs(w, timestamp, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+static void captureWriterClose(struct captureWriter *w) {
+    for (unsigned int i = 0; i < w->numFormats; i++) {
+        free(w->compiled[i]);
+    }
+    for (unsigned int slot = 0; w->keyByContent && slot < CAPTURE_FORMAT_SLOTS; slot++) {
+        free((char*) w->slots[slot].fmt);
+        w->slots[slot].fmt = NULL;
+    }
+    w->numFormats = 0;
+    fflush(w->file);
+}
+
+static int captureReaderOpen(struct captureReader *r, FILE* file) {
+    char magic[CAPTURE_MAGIC_SIZE];
+
+    r->file = file;
+    r->numFormats = 0;
+    if (fread(magic, CAPTURE_MAGIC_SIZE, 1, file) != 1 || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void captureReaderClose(struct captureReader *r) {
+    for (unsigned int i = 0; i < r->numFormats; i++) {
+        free(r->formats[i]);
+        free(r->compiled[i]);
+    }
+    r->numFormats = 0;
+}
+
+//Reads the next record into r->entry and r->payload, taking in any format definitions on the way.
+//Returns 1 for a record, 0 at the end of the capture and -1 if the capture is malformed.
+static int captureNext(struct captureReader *r) {
+    for (;;) {
+        struct captureEntry *e = &r->entry;
+        unsigned int id;
+
+        if (fread(e, sizeof (*e), 1, r->file) != 1) {
+            return feof(r->file) ? 0 : -1;
+        }
+        if (e->payloadLength > CAPTURE_MAX_PAYLOAD || fread(r->payload, 1, e->payloadLength, r->file) != e->payloadLength) {
+            return -1;
+        }
+        if (!(e->formatId & CAPTURE_DEFINE_FORMAT)) {
+            return e->formatId < r->numFormats ? 1 : -1;
+        }
+
+        //Formats are defined in ID order.
+        id = e->formatId & ~CAPTURE_DEFINE_FORMAT;
+        if (id != r->numFormats || id == CAPTURE_MAX_FORMATS) {
+            return -1;
+        }
+        r->formats[id] = malloc(e->payloadLength + 1);
+        r->compiled[id] = malloc(sizeof (struct compiledFormat));
+        if (!r->formats[id] || !r->compiled[id]) {
+            free(r->formats[id]);
+            free(r->compiled[id]);
+            return -1;
+        }
+        memcpy(r->formats[id], r->payload, e->payloadLength);
+        r->formats[id][e->payloadLength] = '\0';
+        r->numFormats++;
+        if (compileFormat(r->compiled[id], r->formats[id]) < 0) {
+            return -1;
+        }
+    }
+}
+
+//Formats the record captureNext last read, like myPrintf would have.
+static int captureDecode(struct captureReader *r, char* output, size_t out_size) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    const struct compiledFormat *cf = r->compiled[r->entry.formatId];
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    int ret;
+
+    TRACE_BEGIN("decode");
+    if (captureUnpackArgs(cf, argBlock, r->payload, r->entry.payloadLength) < 0) {
+        TRACE_END("decode");
+        return -1;
+    }
+    ret = formatArgBlockMeasured(cf, output, &outPos, outputSpace(out_size), argBlock, &overflow);
+    terminateOutput(output, outPos, out_size);
+    TRACE_END("decode");
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Workload recording: while a recorder is attached, every myPrintf call is also written to a capture as its format
+//and argument bytes, so that a production argument mix can be replayed later by any build (see the replay
+//benchmark). Calls are serialized on a spinlock, and calls that can't be captured are only counted.
+struct workloadRecorder {
+    struct captureWriter writer;
+    atomic_flag lock;
+    atomic_ulong recorded;
+    atomic_ulong dropped;
+};
+
+//Starts recording myPrintf calls to file. Returns 0 on success.
+static int workloadRecordStart(FILE* file) {
+    struct workloadRecorder *rec = calloc(1, sizeof (*rec));
+
+    if (!rec || captureWriterOpen(&rec->writer, file, 0) < 0) {
+        free(rec);
+        return -1;
+    }
+    //myPrintf's callers may build formats in buffers they reuse, so the same address can hold different formats.
+    rec->writer.keyByContent = 1;
+    atomic_flag_clear(&rec->lock);
+    atomic_store(&workloadRecorder, rec);
+    return 0;
+}
+
+//Stops recording and returns the number of calls recorded. Other threads may carry on calling myPrintf: the
+//recorder is detached first and only freed once no call can still be using it. The caller still owns the file.
+static unsigned long workloadRecordStop() {
+    struct workloadRecorder *rec = atomic_exchange(&workloadRecorder, NULL);
+    unsigned long recorded;
+
+    if (!rec) {
+        return 0;
+    }
+    //A call that registered before the exchange may have seen rec; any later one sees NULL.
+    while (atomic_load(&workloadRecordCalls)) {
+    }
+    recorded = atomic_load(&rec->recorded);
+    captureWriterClose(&rec->writer);
+    free(rec);
+    return recorded;
+}
+
+static void workloadRecord(const char* fmt, va_list args) {
+    struct workloadRecorder *rec;
+    int ret;
+
+    //Register before looking at the recorder again, so that workloadRecordStop either waits for this call or
+    //has already detached the recorder by the time it's loaded.
+    atomic_fetch_add(&workloadRecordCalls, 1);
+    rec = atomic_load(&workloadRecorder);
+    if (rec) {
+        while (atomic_flag_test_and_set_explicit(&rec->lock, memory_order_acquire)) {
+        }
+        ret = captureRecordArgs(&rec->writer, monotonicNanoseconds(0), fmt, args);
+        atomic_flag_clear_explicit(&rec->lock, memory_order_release);
+        atomic_fetch_add_explicit(ret < 0 ? &rec->dropped : &rec->recorded, 1, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&workloadRecordCalls, 1, memory_order_release);
+}
+
+//Is input a's current record due before input b's? Ties go to the lower rank, then the earlier input.
+static int captureMergeBefore(struct captureReader **readers, unsigned int a, unsigned int b) {
+    if (readers[a]->entry.timestamp != readers[b]->entry.timestamp) {
+        return readers[a]->entry.timestamp < readers[b]->entry.timestamp;
+    }
+    if (readers[a]->entry.rank != readers[b]->entry.rank) {
+        return readers[a]->entry.rank < readers[b]->entry.rank;
+    }
+    return a < b;
+}
+
+static void captureMergeSiftDown(struct captureReader **readers, unsigned int *heap, unsigned int heapSize, unsigned int i) {
+    for (;;) {
+        unsigned int smallest = i, left = 2 * i + 1, right = 2 * i + 2, tmp;
+        if (left < heapSize && captureMergeBefore(readers, heap[left], heap[smallest])) smallest = left;
+        if (right < heapSize && captureMergeBefore(readers, heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+//Merges captures from several processes into one capture ordered by timestamp, with every record keeping the rank
+//its writer gave it. Each input has its own format IDs; the output has one table, with
+//identical format strings sharing an ID. This is a streaming k-way merge, so memory use depends on the number of
+//inputs and formats, not the size of the captures. Each input must already be in timestamp order.
+//Returns the number of records merged, or -1 on failure.
+static long captureMerge(FILE** inputs, unsigned int numInputs, FILE* output) {
+    struct captureReader **readers = calloc(numInputs, sizeof (*readers));
+    unsigned int *heap = calloc(numInputs, sizeof (*heap));
+    uint32_t *unifiedIds = calloc((size_t) numInputs * CAPTURE_MAX_FORMATS, sizeof (uint32_t));
+    struct captureFormatSlot slots[CAPTURE_FORMAT_SLOTS];
+    unsigned int heapSize = 0, numUnified = 0;
+    long merged = -1;
+
+    memset(slots, 0, sizeof (slots));
+    if (!readers || !heap || !unifiedIds || captureWriteMagic(output) < 0) {
+        goto done;
+    }
+    for (unsigned int i = 0; i < numInputs; i++) {
+        int ret;
+        if (!(readers[i] = malloc(sizeof (struct captureReader))) || captureReaderOpen(readers[i], inputs[i]) < 0) {
+            goto done;
+        }
+        if ((ret = captureNext(readers[i])) < 0) {
+            goto done;
+        }
+        if (ret) {
+            heap[heapSize++] = i;
+        }
+    }
+    for (unsigned int i = heapSize / 2; i-- > 0;) {
+        captureMergeSiftDown(readers, heap, heapSize, i);
+    }
+
+    merged = 0;
+    while (heapSize) {
+        unsigned int input = heap[0];
+        struct captureReader *r = readers[input];
+        uint32_t localId = r->entry.formatId;
+        int ret;
+
+        //Map this input's format ID onto the unified table the first time we see it.
+        if (unifiedIds[input * CAPTURE_MAX_FORMATS + localId] == 0) {
+            const char *fmt = r->formats[localId];
+            unsigned int slot = captureHash(fmt, strlen(fmt)) % CAPTURE_FORMAT_SLOTS;
+            while (slots[slot].fmt && strcmp(slots[slot].fmt, fmt)) {
+                slot = (slot + 1) % CAPTURE_FORMAT_SLOTS;
+            }
+            if (!slots[slot].fmt) {
+                if (numUnified == CAPTURE_MAX_FORMATS
+                    || captureWriteEntry(output, 0, CAPTURE_DEFINE_FORMAT | numUnified, 0, fmt, strlen(fmt)) < 0) {
+                    merged = -1;
+                    goto done;
+                }
+                slots[slot].fmt = fmt;
+                slots[slot].id = numUnified++;
+            }
+            //Stored off by one so that zero means not mapped yet.
+            unifiedIds[input * CAPTURE_MAX_FORMATS + localId] = slots[slot].id + 1;
+        }
+
+        if (captureWriteEntry(output, r->entry.timestamp, unifiedIds[input * CAPTURE_MAX_FORMATS + localId] - 1,
+                              r->entry.rank, r->payload, r->entry.payloadLength) < 0) {
+            merged = -1;
+            goto done;
+        }
+        merged++;
+
+        if ((ret = captureNext(r)) < 0) {
+            merged = -1;
+            goto done;
+        }
+        if (!ret) {
+            heap[0] = heap[--heapSize];
+        }
+        captureMergeSiftDown(readers, heap, heapSize, 0);
+    }
+
+done:
+    //Format strings in the slot table belong to the readers, so they're only freed now.
+    for (unsigned int i = 0; readers && i < numInputs; i++) {
+        if (readers[i]) {
+            captureReaderClose(readers[i]);
+            free(readers[i]);
+        }
+    }
+    free(readers);
+    free(heap);
+    free(unifiedIds);
+    return merged;
+}
+
+#if defined(PRINTF_BENCHMARK) || defined(PRINTF_MERGE_TOOL)
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#if defined(PRINTF_LIBNUMA)
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+//Parallel capture decoding. An index pass splits a capture held in memory into chunks of records and compiles its
+//formats; a pool of workers then formats the chunks. On a NUMA machine each chunk goes to the queue of the node
+//whose memory holds it, workers are pinned to that node's CPUs and drain their own node's queue before stealing
+//from the others, and each worker stages its text in a buffer it first touched itself, so both the capture reads
+//and the output writes stay on the socket. The topology comes from libnuma when it's built in (PRINTF_LIBNUMA)
+//and from /sys otherwise; a machine without either is treated as a single node.
+#define DECODE_MAX_NODES 16
+#define DECODE_MAX_CPUS 1024
+#define DECODE_CHUNK_RECORDS 4096
+#define DECODE_LINE_SIZE 4096
+
+struct numaTopology {
+    unsigned int numNodes;
+    unsigned int totalCpus;
+    int nodeIds[DECODE_MAX_NODES];
+    unsigned int numCpus[DECODE_MAX_NODES];
+    unsigned short cpus[DECODE_MAX_NODES][DECODE_MAX_CPUS];
+};
+
+struct decodeChunk {
+    //Byte range of the chunk in the capture, and the topology index of the node holding it.
+    size_t start;
+    size_t end;
+    unsigned int node;
+    //Where the worker that decoded the chunk staged its text.
+    unsigned int worker;
+    size_t offset;
+    size_t length;
+};
+
+struct decodeWorker {
+    struct parallelDecoder *d;
+    pthread_t thread;
+    int started;
+    unsigned int node;
+    int cpu;
+    char *staging;
+    size_t stagingSize;
+    size_t stagingUsed;
+    int failed;
+};
+
+struct parallelDecoder {
+    const char *capture;
+    size_t size;
+    //Prefix each line with its record's rank, like printf_merge -d.
+    int prefixRank;
+    unsigned int numFormats;
+    char *formats[CAPTURE_MAX_FORMATS];
+    struct compiledFormat *compiled[CAPTURE_MAX_FORMATS];
+    struct decodeChunk *chunks;
+    unsigned int numChunks;
+    unsigned long numRecords;
+    struct numaTopology topology;
+    //Chunk indices queued on each node, in capture order, and the next one to hand out.
+    unsigned int *nodeChunks;
+    unsigned int nodeFirst[DECODE_MAX_NODES + 1];
+    atomic_uint nodeNext[DECODE_MAX_NODES];
+    unsigned int numQueues;
+    int pinned;
+    struct decodeWorker *workers;
+    unsigned int numWorkers;
+};
+
+//Parses a kernel CPU or node list such as "0-3,8,10-11". Returns the number of entries stored.
+static unsigned int numaParseList(const char* list, unsigned short *out, unsigned int max) {
+    unsigned int count = 0;
+
+    while (*list && *list != '\n') {
+        char *end;
+        unsigned long first = strtoul(list, &end, 10), last = first;
+        if (end == list) {
+            break;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+        }
+        for (unsigned long i = first; i <= last && count < max; i++) {
+            out[count++] = (unsigned short) i;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static int numaReadList(const char* path, unsigned short *out, unsigned int max) {
+    FILE *file = fopen(path, "r");
+    char line[4096];
+    int count = -1;
+
+    if (file) {
+        if (fgets(line, sizeof (line), file)) {
+            count = (int) numaParseList(line, out, max);
+        }
+        fclose(file);
+    }
+    return count;
+}
+
+static void numaDiscover(struct numaTopology *t) {
+    unsigned short nodes[DECODE_MAX_NODES];
+    int numNodes;
+
+    t->numNodes = 0;
+    t->totalCpus = 0;
+#if defined(PRINTF_LIBNUMA)
+    if (numa_available() >= 0) {
+        struct bitmask *cpus = numa_allocate_cpumask();
+        for (int node = 0; node <= numa_max_node() && t->numNodes < DECODE_MAX_NODES; node++) {
+            unsigned int n = t->numNodes;
+            if (!numa_bitmask_isbitset(numa_nodes_ptr, node) || numa_node_to_cpus(node, cpus) < 0) {
+                continue;
+            }
+            t->numCpus[n] = 0;
+            for (unsigned int cpu = 0; cpu < cpus->size && cpu < DECODE_MAX_CPUS; cpu++) {
+                if (numa_bitmask_isbitset(cpus, cpu)) {
+                    t->cpus[n][t->numCpus[n]++] = (unsigned short) cpu;
+                }
+            }
+            //Memory-only nodes have nothing to run decoders on.
+            if (t->numCpus[n]) {
+                t->nodeIds[t->numNodes++] = node;
+                t->totalCpus += t->numCpus[n];
+            }
+        }
+        numa_free_cpumask(cpus);
+    }
+#endif
+    if (!t->numNodes && (numNodes = numaReadList("/sys/devices/system/node/online", nodes, DECODE_MAX_NODES)) > 0) {
+        for (int i = 0; i < numNodes; i++) {
+            char path[64];
+            int numCpus;
+            snprintf(path, sizeof (path), "/sys/devices/system/node/node%u/cpulist", nodes[i]);
+            if ((numCpus = numaReadList(path, t->cpus[t->numNodes], DECODE_MAX_CPUS)) > 0) {
+                t->numCpus[t->numNodes] = numCpus;
+                t->nodeIds[t->numNodes++] = nodes[i];
+                t->totalCpus += numCpus;
+            }
+        }
+    }
+    if (!t->numNodes) {
+#if defined(__linux__)
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        long online = 1;
+#endif
+        t->numCpus[0] = online < 1 ? 1 : online > DECODE_MAX_CPUS ? DECODE_MAX_CPUS : online;
+        for (unsigned int cpu = 0; cpu < t->numCpus[0]; cpu++) {
+            t->cpus[0][cpu] = cpu;
+        }
+        t->nodeIds[0] = 0;
+        t->numNodes = 1;
+        t->totalCpus = t->numCpus[0];
+    }
+}
+
+//Topology index of the node holding the page at address, or -1 if the kernel won't say.
+static int numaNodeOfAddress(const struct numaTopology *t, const void* address) {
+    int node = -1;
+
+#if defined(PRINTF_LIBNUMA)
+    if (get_mempolicy(&node, NULL, 0, (void*) address, MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+        return -1;
+    }
+#elif defined(__linux__) && defined(SYS_get_mempolicy)
+    //MPOL_F_NODE | MPOL_F_ADDR: the node of the page at address rather than the policy's.
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, address, 1UL | 2UL) < 0) {
+        return -1;
+    }
+#endif
+    for (unsigned int i = 0; i < t->numNodes; i++) {
+        if (t->nodeIds[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//Pins the calling thread to one CPU. Returns -1 where affinity isn't supported.
+static int numaPinThread(int cpu) {
+#if defined(__linux__) && defined(SYS_sched_setaffinity)
+    unsigned long mask[DECODE_MAX_CPUS / (8 * sizeof (unsigned long))] = {0};
+
+    mask[cpu / (8 * sizeof (unsigned long))] = 1UL << (cpu % (8 * sizeof (unsigned long)));
+    return syscall(SYS_sched_setaffinity, 0, sizeof (mask), mask) < 0 ? -1 : 0;
+#else
+    (void) cpu;
+    return -1;
+#endif
+}
+
+static void parallelDecoderClose(struct parallelDecoder *d) {
+    for (unsigned int i = 0; i < d->numFormats; i++) {
+        free(d->formats[i]);
+        free(d->compiled[i]);
+    }
+    for (unsigned int w = 0; w < d->numWorkers; w++) {
+        free(d->workers[w].staging);
+    }
+    free(d->workers);
+    free(d->chunks);
+    free(d->nodeChunks);
+    d->numFormats = 0;
+    d->numWorkers = 0;
+    d->workers = NULL;
+    d->chunks = NULL;
+    d->nodeChunks = NULL;
+}
+
+//Indexes a capture of size bytes at capture, which must stay in place until the decoder is closed: compiles its
+//formats, splits its records into chunks and finds the node holding each chunk.
+//Returns 0, or -1 if the capture is malformed or memory runs out.
+static int parallelDecoderOpen(struct parallelDecoder *d, const char* capture, size_t size) {
+    size_t pos = CAPTURE_MAGIC_SIZE, chunkStart = pos;
+    unsigned int chunkRecords = 0, maxChunks = 64;
+
+    memset(d, 0, sizeof (*d));
+    d->capture = capture;
+    d->size = size;
+    numaDiscover(&d->topology);
+    if (size < CAPTURE_MAGIC_SIZE || memcmp(capture, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)
+        || !(d->chunks = malloc(maxChunks * sizeof (*d->chunks)))) {
+        return -1;
+    }
+
+    while (pos < size) {
+        struct captureEntry e;
+        unsigned int id;
+
+        if (size - pos < sizeof (e)) {
+            goto malformed;
+        }
+        memcpy(&e, capture + pos, sizeof (e));
+        if (e.payloadLength > CAPTURE_MAX_PAYLOAD || size - pos - sizeof (e) < e.payloadLength) {
+            goto malformed;
+        }
+        if (!(e.formatId & CAPTURE_DEFINE_FORMAT)) {
+            if (e.formatId >= d->numFormats) {
+                goto malformed;
+            }
+            chunkRecords++;
+            d->numRecords++;
+        } else {
+            //Formats are defined in ID order, before the first record using them, so one table serves every chunk.
+            id = e.formatId & ~CAPTURE_DEFINE_FORMAT;
+            if (id != d->numFormats || id == CAPTURE_MAX_FORMATS) {
+                goto malformed;
+            }
+            d->formats[id] = malloc(e.payloadLength + 1);
+            d->compiled[id] = malloc(sizeof (struct compiledFormat));
+            if (!d->formats[id] || !d->compiled[id]) {
+                free(d->formats[id]);
+                free(d->compiled[id]);
+                goto malformed;
+            }
+            memcpy(d->formats[id], capture + pos + sizeof (e), e.payloadLength);
+            d->formats[id][e.payloadLength] = '\0';
+            d->numFormats++;
+            if (compileFormat(d->compiled[id], d->formats[id]) < 0) {
+                goto malformed;
+            }
+        }
+        pos += sizeof (e) + e.payloadLength;
+
+        if (chunkRecords == DECODE_CHUNK_RECORDS || (pos == size && chunkRecords)) {
+            if (d->numChunks == maxChunks) {
+                struct decodeChunk *grown = realloc(d->chunks, 2 * maxChunks * sizeof (*d->chunks));
+                if (!grown) {
+                    goto malformed;
+                }
+                d->chunks = grown;
+                maxChunks *= 2;
+            }
+            d->chunks[d->numChunks].start = chunkStart;
+            d->chunks[d->numChunks].end = pos;
+            d->numChunks++;
+            chunkStart = pos;
+            chunkRecords = 0;
+        }
+    }
+
+    //A chunk's home is the node holding its first page. Pages the kernel won't place are spread round-robin.
+    for (unsigned int c = 0; c < d->numChunks; c++) {
+        int node = numaNodeOfAddress(&d->topology, capture + d->chunks[c].start);
+        d->chunks[c].node = node < 0 ? c % d->topology.numNodes : (unsigned int) node;
+    }
+    if (!(d->nodeChunks = malloc((d->numChunks + 1) * sizeof (*d->nodeChunks)))) {
+        goto malformed;
+    }
+    return 0;
+
+malformed:
+    parallelDecoderClose(d);
+    return -1;
+}
+
+//Makes room for needed more bytes of staged text. The staging buffer is only ever grown by its own worker, on its
+//own node.
+static int decodeGrowStaging(struct decodeWorker *w, size_t needed) {
+    size_t grownSize = w->stagingSize ? w->stagingSize : 1 << 20;
+    char *grown;
+
+    while (grownSize - w->stagingUsed < needed) {
+        grownSize *= 2;
+    }
+    if (grownSize == w->stagingSize) {
+        return 0;
+    }
+    if (!(grown = realloc(w->staging, grownSize))) {
+        return -1;
+    }
+    w->staging = grown;
+    w->stagingSize = grownSize;
+    return 0;
+}
+
+static int decodeChunk(struct decodeWorker *w, struct decodeChunk *chunk) {
+    struct parallelDecoder *d = w->d;
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    size_t pos = chunk->start;
+
+    chunk->offset = w->stagingUsed;
+    while (pos < chunk->end) {
+        struct captureEntry e;
+        const struct compiledFormat *cf;
+        size_t overflow = 1;
+
+        memcpy(&e, d->capture + pos, sizeof (e));
+        if (e.formatId & CAPTURE_DEFINE_FORMAT) {
+            pos += sizeof (e) + e.payloadLength;
+            continue;
+        }
+        cf = d->compiled[e.formatId];
+        if (captureUnpackArgs(cf, argBlock, (char*) d->capture + pos + sizeof (e), e.payloadLength) < 0) {
+            return -1;
+        }
+        //Room for a typical line up front. A longer one is measured, and rendered again once there's room for it.
+        for (size_t needed = DECODE_LINE_SIZE; overflow; ) {
+            unsigned int outPos = 0;
+            char *line;
+
+            if (decodeGrowStaging(w, needed) < 0) {
+                return -1;
+            }
+            line = w->staging + w->stagingUsed;
+            overflow = 0;
+            if ((d->prefixRank && formatAtMeasured(line, &outPos, needed, &overflow, "[%u] ", e.rank) < 0)
+                || formatArgBlockMeasured(cf, line, &outPos, needed, argBlock, &overflow) < 0) {
+                return -1;
+            }
+            if (!overflow) {
+                w->stagingUsed += outPos;
+            }
+            needed = outPos + overflow;
+        }
+        pos += sizeof (e) + e.payloadLength;
+    }
+    chunk->worker = w - d->workers;
+    chunk->length = w->stagingUsed - chunk->offset;
+    return 0;
+}
+
+static void* decodeWorkerMain(void* arg) {
+    struct decodeWorker *w = arg;
+    struct parallelDecoder *d = w->d;
+
+    if (d->pinned) {
+        numaPinThread(w->cpu);
+    }
+    //Own node's queue first, then help the others.
+    for (unsigned int n = 0; n < d->numQueues && !w->failed; n++) {
+        unsigned int queue = (w->node + n) % d->numQueues, i;
+        while ((i = atomic_fetch_add_explicit(&d->nodeNext[queue], 1, memory_order_relaxed))
+               < d->nodeFirst[queue + 1] - d->nodeFirst[queue]) {
+            if (decodeChunk(w, &d->chunks[d->nodeChunks[d->nodeFirst[queue] + i]]) < 0) {
+                w->failed = 1;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+//Decodes every chunk with numThreads workers (0 for one per CPU). numaAware queues chunks on their home nodes and
+//pins the workers; otherwise every worker pulls from one queue in capture order and runs wherever the scheduler
+//puts it. Returns 0, or -1 if a record is malformed or memory runs out.
+static int parallelDecode(struct parallelDecoder *d, unsigned int numThreads, int numaAware) {
+    const struct numaTopology *t = &d->topology;
+    unsigned int pos = 0, started = 0;
+    int ret = 0;
+
+    for (unsigned int w = 0; w < d->numWorkers; w++) {
+        free(d->workers[w].staging);
+    }
+    free(d->workers);
+    d->numWorkers = numThreads ? numThreads : t->totalCpus;
+    if (!(d->workers = calloc(d->numWorkers, sizeof (*d->workers)))) {
+        d->numWorkers = 0;
+        return -1;
+    }
+    d->pinned = numaAware;
+    d->numQueues = numaAware ? t->numNodes : 1;
+    for (unsigned int q = 0; q < d->numQueues; q++) {
+        d->nodeFirst[q] = pos;
+        for (unsigned int c = 0; c < d->numChunks; c++) {
+            if (!numaAware || d->chunks[c].node == q) {
+                d->nodeChunks[pos++] = c;
+            }
+        }
+        atomic_store(&d->nodeNext[q], 0);
+    }
+    d->nodeFirst[d->numQueues] = pos;
+
+    //Workers are dealt out to the nodes in turn, each taking the next CPU on its node.
+    for (unsigned int w = 0; w < d->numWorkers; w++) {
+        struct decodeWorker *worker = &d->workers[w];
+        worker->d = d;
+        worker->node = numaAware ? w % t->numNodes : 0;
+        worker->cpu = t->cpus[w % t->numNodes][(w / t->numNodes) % t->numCpus[w % t->numNodes]];
+        worker->started = pthread_create(&worker->thread, NULL, decodeWorkerMain, worker) == 0;
+    }
+    for (unsigned int w = 0; w < d->numWorkers; w++) {
+        if (d->workers[w].started) {
+            pthread_join(d->workers[w].thread, NULL);
+            started++;
+        }
+        ret |= d->workers[w].failed ? -1 : 0;
+    }
+    //Workers steal from every queue, so one is enough to finish the job.
+    return started ? ret : -1;
+}
+
+//Reads a whole capture file into memory for parallelDecoderOpen. Its pages land wherever the memory policy puts
+//them (numactl --membind or --interleave, say). Returns NULL on failure.
+static char* parallelDecoderLoad(FILE* file, size_t *size) {
+    size_t capacity = 1 << 20;
+    char *capture = malloc(capacity);
+
+    *size = 0;
+    while (capture) {
+        size_t got = fread(capture + *size, 1, capacity - *size, file);
+        *size += got;
+        if (*size < capacity) {
+            if (ferror(file)) {
+                break;
+            }
+            return capture;
+        }
+        char *grown = realloc(capture, 2 * capacity);
+        if (!grown) {
+            break;
+        }
+        capture = grown;
+        capacity *= 2;
+    }
+    free(capture);
+    return NULL;
+}
+
+//Writes the decoded text in capture order. Returns 0, or -1 on a write error.
+static int parallelDecoderWrite(const struct parallelDecoder *d, FILE* output) {
+    for (unsigned int c = 0; c < d->numChunks; c++) {
+        const struct decodeChunk *chunk = &d->chunks[c];
+        if (chunk->length && fwrite(d->workers[chunk->worker].staging + chunk->offset, 1, chunk->length, output)
+            != chunk->length) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+//Aggregation mode: printf calls that only exist to look at value distributions don't produce text. Instead
+//each numeric argument of a selected format is folded into a running count/min/max/sum and a histogram of
+//power-of-two buckets by magnitude. Every thread updates its own shard with plain (relaxed) loads and stores,
+//and aggregateSummary merges the shards without stopping the producers.
+#define AGGREGATE_MAX_FORMATS 64
+#define AGGREGATE_MAX_ARGS 8
+#define AGGREGATE_MAX_SHARDS 64
+//Bucket 0 holds |x| < 1, bucket b holds 2^(b-1) <= |x| < 2^b, and the last bucket everything larger.
+#define AGGREGATE_BUCKETS 64
+
+struct argumentAggregate {
+    atomic_ulong count;
+    _Atomic double min;
+    _Atomic double max;
+    _Atomic double sum;
+    atomic_ulong buckets[AGGREGATE_BUCKETS];
+};
+
+struct aggregateShard {
+    //The thread writing to the shard, see aggregateThreadCache.
+    const void *owner;
+    struct argumentAggregate stats[AGGREGATE_MAX_FORMATS][AGGREGATE_MAX_ARGS];
+};
+
+struct aggregator {
+    //Tells apart aggregators initialized at the same address, so stale thread caches can't match.
+    unsigned long generation;
+    unsigned int numFormats;
+    struct compiledFormat formats[AGGREGATE_MAX_FORMATS];
+    struct captureFormatSlot slots[2 * AGGREGATE_MAX_FORMATS];
+    atomic_uint numShards;
+    struct aggregateShard *_Atomic shards[AGGREGATE_MAX_SHARDS];
+};
+
+//Each thread remembers its shards in the last few aggregators it used. A miss looks for the thread's shard in the
+//aggregator before making a new one, so a thread has one shard per aggregator however it moves between them. The
+//cache's address identifies the thread.
+#define AGGREGATE_THREAD_CACHE 4
+
+static _Thread_local struct {
+    const struct aggregator *agg;
+    unsigned long generation;
+    struct aggregateShard *shard;
+} aggregateThreadCache[AGGREGATE_THREAD_CACHE];
+static _Thread_local unsigned int aggregateThreadCacheNext;
+static atomic_ulong aggregatorGenerations;
+
+#define AGGREGATE_LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define AGGREGATE_STORE(field, value) atomic_store_explicit(&(field), (value), memory_order_relaxed)
+
+static void aggregatorInit(struct aggregator *agg) {
+    memset(agg, 0, sizeof (*agg));
+    agg->generation = atomic_fetch_add(&aggregatorGenerations, 1) + 1;
+}
+
+static void aggregatorFree(struct aggregator *agg) {
+    unsigned int numShards = atomic_load(&agg->numShards);
+
+    for (unsigned int i = 0; i < numShards && i < AGGREGATE_MAX_SHARDS; i++) {
+        free(atomic_load(&agg->shards[i]));
+        atomic_store(&agg->shards[i], NULL);
+    }
+    atomic_store(&agg->numShards, 0);
+    agg->generation = 0;
+}
+
+//Selects fmt for aggregation. Must be called before any thread starts printing with it.
+//The format string must stay at the same address for the life of the aggregator.
+static int aggregateSelect(struct aggregator *agg, const char* fmt) {
+    unsigned int slot = captureHash(&fmt, sizeof (fmt)) % (2 * AGGREGATE_MAX_FORMATS);
+
+    while (agg->slots[slot].fmt) {
+        if (agg->slots[slot].fmt == fmt) {
+            return agg->slots[slot].id;
+        }
+        slot = (slot + 1) % (2 * AGGREGATE_MAX_FORMATS);
+    }
+    if (agg->numFormats == AGGREGATE_MAX_FORMATS || compileFormat(&agg->formats[agg->numFormats], fmt) < 0) {
+        return -1;
+    }
+    agg->slots[slot].fmt = fmt;
+    agg->slots[slot].id = agg->numFormats;
+    return agg->numFormats++;
+}
+
+static int aggregateLookup(const struct aggregator *agg, const char* fmt) {
+    unsigned int slot = captureHash(&fmt, sizeof (fmt)) % (2 * AGGREGATE_MAX_FORMATS);
+
+    while (agg->slots[slot].fmt) {
+        if (agg->slots[slot].fmt == fmt) {
+            return agg->slots[slot].id;
+        }
+        slot = (slot + 1) % (2 * AGGREGATE_MAX_FORMATS);
+    }
+    return -1;
+}
+
+static struct aggregateShard* aggregateThreadShard(struct aggregator *agg) {
+    const void *self = aggregateThreadCache;
+    struct aggregateShard *shard = NULL;
+    unsigned int index, slot;
+
+    for (slot = 0; slot < AGGREGATE_THREAD_CACHE; slot++) {
+        if (aggregateThreadCache[slot].agg == agg && aggregateThreadCache[slot].generation == agg->generation) {
+            return aggregateThreadCache[slot].shard;
+        }
+    }
+
+    index = atomic_load(&agg->numShards);
+    for (unsigned int i = 0; i < index && i < AGGREGATE_MAX_SHARDS; i++) {
+        struct aggregateShard *candidate = atomic_load_explicit(&agg->shards[i], memory_order_acquire);
+        if (candidate && candidate->owner == self) {
+            shard = candidate;
+            break;
+        }
+    }
+    if (!shard) {
+        //Only claim an index while there's one left, so numShards never runs past the array.
+        do {
+            if (index >= AGGREGATE_MAX_SHARDS) {
+                return NULL;
+            }
+        } while (!atomic_compare_exchange_weak(&agg->numShards, &index, index + 1));
+        if (!(shard = calloc(1, sizeof (*shard)))) {
+            return NULL;
+        }
+        shard->owner = self;
+        for (unsigned int f = 0; f < AGGREGATE_MAX_FORMATS; f++) {
+            for (unsigned int a = 0; a < AGGREGATE_MAX_ARGS; a++) {
+                atomic_init(&shard->stats[f][a].min, INFINITY);
+                atomic_init(&shard->stats[f][a].max, -INFINITY);
+            }
+        }
+        atomic_store_explicit(&agg->shards[index], shard, memory_order_release);
+    }
+
+    slot = aggregateThreadCacheNext++ % AGGREGATE_THREAD_CACHE;
+    aggregateThreadCache[slot].agg = agg;
+    aggregateThreadCache[slot].generation = agg->generation;
+    aggregateThreadCache[slot].shard = shard;
+    return shard;
+}
+
+static void aggregateValue(struct argumentAggregate *a, double value) {
+    double magnitude = fabs(value);
+    int bucket = 0;
+
+    if (magnitude >= 1.0) {
+        frexp(magnitude, &bucket);
+        if (bucket >= AGGREGATE_BUCKETS || isnan(magnitude)) {
+            bucket = AGGREGATE_BUCKETS - 1;
+        }
+    }
+    AGGREGATE_STORE(a->count, AGGREGATE_LOAD(a->count) + 1);
+    AGGREGATE_STORE(a->sum, AGGREGATE_LOAD(a->sum) + value);
+    if (value < AGGREGATE_LOAD(a->min)) AGGREGATE_STORE(a->min, value);
+    if (value > AGGREGATE_LOAD(a->max)) AGGREGATE_STORE(a->max, value);
+    AGGREGATE_STORE(a->buckets[bucket], AGGREGATE_LOAD(a->buckets[bucket]) + 1);
+}
+
+//myPrintf, except that selected formats have their numeric arguments aggregated instead of being printed, in which
+//case output is left empty.
+static int aggregatePrintf(struct aggregator *agg, char* output, size_t out_size, const char* fmt, ...) {
+    int id = aggregateLookup(agg, fmt);
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    const struct compiledFormat *cf;
+    struct aggregateShard *shard;
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    if (id < 0) {
+        ret = myPrintf(output, out_size, fmt, args);
+        va_end(args);
+        return ret;
+    }
+    cf = &agg->formats[id];
+    ret = readArgBlock(cf, argBlock, args);
+    va_end(args);
+    if (out_size) {
+        output[0] = '\0';
+    }
+    if (ret < 0 || !(shard = aggregateThreadShard(agg))) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < cf->numArgs && i < AGGREGATE_MAX_ARGS; i++) {
+        switch (cf->argTypes[i]) {
+            case ARG_INT: case ARG_LONG:
+                aggregateValue(&shard->stats[id][i], (double) argBlock[i].i);
+                break;
+            case ARG_UNSIGNED: case ARG_UNSIGNED_LONG:
+                aggregateValue(&shard->stats[id][i], (double) argBlock[i].u);
+                break;
+            case ARG_DOUBLE:
+                aggregateValue(&shard->stats[id][i], argBlock[i].d);
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+//Merges every thread's shard and prints a summary table for each selected format.
+//Returns its length, or -1 if it didn't fit.
+static int aggregateSummary(struct aggregator *agg, char* output, size_t out_size) {
+    unsigned int numShards = atomic_load(&agg->numShards);
+    struct printBuilder b;
+
+    if (numShards > AGGREGATE_MAX_SHARDS) {
+        numShards = AGGREGATE_MAX_SHARDS;
+    }
+    builderInit(&b, output, out_size);
+    for (unsigned int f = 0; f < agg->numFormats; f++) {
+        builderAppendLiteral(&b, "format: ");
+        builderAppendLiteral(&b, agg->formats[f].fmt);
+        if (b.pos && b.output[b.pos - 1] != '\n') {
+            builderAppendLiteral(&b, "\n");
+        }
+        for (unsigned int a = 0; a < agg->formats[f].numArgs && a < AGGREGATE_MAX_ARGS; a++) {
+            unsigned long count = 0, buckets[AGGREGATE_BUCKETS] = {0};
+            double min = INFINITY, max = -INFINITY, sum = 0;
+
+            for (unsigned int s = 0; s < numShards; s++) {
+                struct aggregateShard *shard = atomic_load_explicit(&agg->shards[s], memory_order_acquire);
+                struct argumentAggregate *stats;
+                if (!shard) {
+                    continue;
+                }
+                stats = &shard->stats[f][a];
+                count += AGGREGATE_LOAD(stats->count);
+                sum += AGGREGATE_LOAD(stats->sum);
+                if (AGGREGATE_LOAD(stats->min) < min) min = AGGREGATE_LOAD(stats->min);
+                if (AGGREGATE_LOAD(stats->max) > max) max = AGGREGATE_LOAD(stats->max);
+                for (unsigned int i = 0; i < AGGREGATE_BUCKETS; i++) {
+                    buckets[i] += AGGREGATE_LOAD(stats->buckets[i]);
+                }
+            }
+            if (!count) {
+                continue;
+            }
+
+            builderAppendFormat(&b, "  arg %u: count %lu min %.3f max %.3f mean %.3f\n", a + 1, count, min, max, sum / count);
+            for (unsigned int i = 0; i < AGGREGATE_BUCKETS; i++) {
+                if (!buckets[i]) {
+                    continue;
+                }
+                if (i == 0) {
+                    builderAppendFormat(&b, "    |x| < 1: %lu\n", buckets[i]);
+                } else {
+                    builderAppendFormat(&b, "    2^%u <= |x| < 2^%u: %lu\n", i - 1, i, buckets[i]);
+                }
+            }
+        }
+    }
+    return builderFinish(&b);
+}
+
+//A cheap, monotonic-ish timestamp for tagging lines: the TSC on x86-64, otherwise the coarse monotonic clock in
+//nanoseconds. Only good for ordering and rough deltas on one host.
+static uint64_t cheapTimestamp() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#define WORK_ITEM_PREFIX_SIZE 96
+#define WORK_ITEM_TIMESTAMP_DIGITS 16
+
+//Each thread's "[group x, item y] " line prefix. It's rendered once when the work-item's ids are set and copied
+//onto every line after that. If timestamps are on, the prefix starts with a fixed-width hex timestamp field whose
+//digits are patched in for each line.
+struct workItemPrefix {
+    char text[WORK_ITEM_PREFIX_SIZE];
+    unsigned int length;
+    int timestamps;
+};
+
+static _Thread_local struct workItemPrefix workItemPrefix;
+
+static int setWorkItemContext(unsigned int group, unsigned int item, int withTimestamp) {
+    struct printBuilder b;
+
+    builderInit(&b, workItemPrefix.text, sizeof (workItemPrefix.text));
+    if (withTimestamp) {
+        builderAppendLiteral(&b, "[t=0000000000000000] ");
+    }
+    builderAppendFormat(&b, "[group %u, item %u] ", group, item);
+    if (builderFinish(&b) < 0) {
+        workItemPrefix.length = 0;
+        return -1;
+    }
+    workItemPrefix.length = b.pos;
+    workItemPrefix.timestamps = withTimestamp;
+    return 0;
+}
+
+static void clearWorkItemContext() {
+    workItemPrefix.length = 0;
+}
+
+//myPrintf with this thread's work-item prefix in front of the line. Returns the length the whole line, prefix
+//included, would have had.
+static int workItemPrintf(char* output, size_t out_size, const char* fmt, ...) {
+    char prefix[WORK_ITEM_PREFIX_SIZE];
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = workItemPrefix.length < space ? workItemPrefix.length : space;
+    size_t overflow = workItemPrefix.length - outPos;
+    va_list args;
+    int ret;
+
+    memcpy(prefix, workItemPrefix.text, workItemPrefix.length);
+    if (workItemPrefix.timestamps) {
+        uint64_t timestamp = cheapTimestamp();
+        for (int i = WORK_ITEM_TIMESTAMP_DIGITS; i > 0; i--) {
+            prefix[3 + i - 1] = "0123456789abcdef"[timestamp & 15];
+            timestamp >>= 4;
+        }
+    }
+    memcpy(output, prefix, outPos);
+
+    va_start(args, fmt);
+    ret = formatTokensMeasured(fmt, output, &outPos, space, args, &overflow);
+    va_end(args);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//A token bucket for one format: up to burst messages at once, refilled at ratePerSecond (0 never refills).
+//Calls over the limit return before touching their arguments and are only counted. The count is reported as a
+//"suppressed N messages" line in front of the next message that gets through, or by rateLimitSummary.
+struct rateLimit {
+    const char *fmt;
+    unsigned int ratePerSecond;
+    int burst;
+    atomic_int tokens;
+    atomic_uint_fast64_t lastRefill;
+    atomic_ulong suppressed;
+};
+
+//Returned by rateLimitedPrintf for a suppressed call.
+#define RATE_LIMITED -2
+
+static void rateLimitInit(struct rateLimit *rl, const char* fmt, unsigned int ratePerSecond, int burst) {
+    rl->fmt = fmt;
+    rl->ratePerSecond = ratePerSecond;
+    rl->burst = burst;
+    atomic_init(&rl->tokens, burst);
+    atomic_init(&rl->lastRefill, monotonicNanoseconds(1));
+    atomic_init(&rl->suppressed, 0);
+}
+
+//Takes a token if there is one. Returns 0 if the call should be suppressed.
+static int rateLimitAllow(struct rateLimit *rl) {
+    uint64_t now = monotonicNanoseconds(1);
+    uint64_t last = atomic_load_explicit(&rl->lastRefill, memory_order_relaxed);
+    int tokens;
+
+    //Whoever moves lastRefill forward gets to add the tokens earned since then. The seconds and the rest are
+    //scaled separately so nothing overflows, and a gap long enough to fill the bucket just fills it.
+    if (rl->ratePerSecond && now - last >= 1000000000u / rl->ratePerSecond) {
+        uint64_t elapsed = now - last, seconds = elapsed / 1000000000u;
+        uint64_t earned = rl->burst, refilled = now;
+        if (seconds < (uint64_t) rl->burst) {
+            earned = seconds * rl->ratePerSecond + elapsed % 1000000000u * rl->ratePerSecond / 1000000000u;
+            refilled = last + earned / rl->ratePerSecond * 1000000000u
+                + earned % rl->ratePerSecond * 1000000000u / rl->ratePerSecond;
+        }
+        if (atomic_compare_exchange_strong(&rl->lastRefill, &last, refilled)) {
+            tokens = atomic_load_explicit(&rl->tokens, memory_order_relaxed);
+            do {
+                if (tokens >= rl->burst) break;
+            } while (!atomic_compare_exchange_weak(&rl->tokens, &tokens,
+                                                   earned >= (uint64_t) (rl->burst - tokens) ? rl->burst : tokens + (int) earned));
+        }
+    }
+
+    tokens = atomic_load_explicit(&rl->tokens, memory_order_relaxed);
+    while (tokens > 0) {
+        if (atomic_compare_exchange_weak(&rl->tokens, &tokens, tokens - 1)) {
+            return 1;
+        }
+    }
+    atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+    return 0;
+}
+
+//Writes the pending "suppressed N messages" line, if any, starting at *outPos. What doesn't fit goes in *overflow.
+static int rateLimitReport(struct rateLimit *rl, char* output, unsigned int *outPos, size_t out_size, size_t *overflow) {
+    unsigned long suppressed = atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
+
+    if (!suppressed) {
+        return 0;
+    }
+    return formatAtMeasured(output, outPos, out_size, overflow, "suppressed %lu messages of \"%s\"\n", suppressed, rl->fmt);
+}
+
+//myPrintf for rl's format, subject to its rate limit. Returns the length the output would have had, suppressed
+//count included, or RATE_LIMITED (leaving output empty) if the call was suppressed.
+static int rateLimitedPrintf(struct rateLimit *rl, char* output, size_t out_size, ...) {
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    if (!rateLimitAllow(rl)) {
+        if (out_size) {
+            output[0] = '\0';
+        }
+        return RATE_LIMITED;
+    }
+
+    ret = rateLimitReport(rl, output, &outPos, space, &overflow);
+    va_start(args, out_size);
+    if (ret == 0) {
+        ret = formatTokensMeasured(rl->fmt, output, &outPos, space, args, &overflow);
+    }
+    va_end(args);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Writes out any suppressed count not yet reported, e.g. at shutdown. Returns its length, 0 if there was none.
+static int rateLimitSummary(struct rateLimit *rl, char* output, size_t out_size) {
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    int ret = rateLimitReport(rl, output, &outPos, outputSpace(out_size), &overflow);
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+//Structured records: formats whose conversions are named, as in "request %{path}s took %{ms}.2f ms", emitted as a
+//JSON object or a logfmt line of the named values instead of text. The literal text is dropped. Field names are
+//quoted, escaped and joined up with the punctuation around them when the format is compiled, so printing only
+//runs the value conversions. Unnamed conversions are called arg1, arg2 and so on.
+typedef enum STRUCTURED_STYLE {
+    STRUCTURED_JSON,
+    STRUCTURED_LOGFMT
+} structuredStyle;
+
+#define STRUCTURED_MAX_FORMAT 256
+#define STRUCTURED_MAX_NAME 32
+#define STRUCTURED_MAX_PREFIXES 1024
+
+struct structuredField {
+    unsigned int prefixStart;
+    unsigned int prefixLength;
+    const struct formatSegment *seg;
+    //A JSON number, printed without width, padding or sign flags, which would make it invalid JSON.
+    int plainNumber;
+};
+
+//cf points into fmt, so a structuredFormat mustn't be copied once compiled.
+struct structuredFormat {
+    structuredStyle style;
+    struct compiledFormat cf;
+    char fmt[STRUCTURED_MAX_FORMAT];
+    unsigned int numFields;
+    struct structuredField fields[MAX_FORMAT_SEGMENTS];
+    char prefixes[STRUCTURED_MAX_PREFIXES];
+    unsigned int prefixesLength;
+};
+
+//Does a logfmt value need quoting?
+static int logfmtNeedsQuotes(const char* s) {
+    if (!*s) {
+        return 1;
+    }
+    for (; *s; s++) {
+        if (*s == ' ' || *s == '=' || *s == '"' || *s == '\\' || (unsigned char) *s < 0x20) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Writes s as a quoted, JSON-escaped string (which is also how logfmt quotes values).
+//printChar for callers that may want to count what doesn't fit in *overflow instead of failing.
+static int printCharMeasured(char* output, unsigned char c, unsigned int *outPos, size_t out_size, size_t *overflow) {
+    if (printChar(output, c, outPos, out_size)) {
+        return 0;
+    }
+    if (!overflow) {
+        return -1;
+    }
+    (*overflow)++;
+    return 0;
+}
+
+//Prints s as a quoted, escaped string. A full buffer fails, unless overflow is given to count what didn't fit.
+static int printQuoted(char* output, unsigned int *outPos, size_t out_size, const char* s, size_t *overflow) {
+    if (printCharMeasured(output, '"', outPos, out_size, overflow) < 0) return -1;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        char escaped[6] = {'\\', c};
+        unsigned int escapedLength = 2;
+        if (c == '\n') {
+            escaped[1] = 'n';
+        } else if (c < 0x20) {
+            memcpy(escaped + 1, "u00", 3);
+            escaped[4] = "0123456789abcdef"[c >> 4];
+            escaped[5] = "0123456789abcdef"[c & 15];
+            escapedLength = 6;
+        } else if (c != '"' && c != '\\') {
+            escaped[0] = c;
+            escapedLength = 1;
+        }
+        for (unsigned int i = 0; i < escapedLength; i++) {
+            if (printCharMeasured(output, escaped[i], outPos, out_size, overflow) < 0) return -1;
+        }
+    }
+    return printCharMeasured(output, '"', outPos, out_size, overflow);
+}
+
+//Field names are escaped in JSON, but logfmt has no quoting for keys, so names that would need it are rejected.
+static int compileStructured(struct structuredFormat *sf, const char* fmt, structuredStyle style) {
+    char names[MAX_FORMAT_SEGMENTS][STRUCTURED_MAX_NAME];
+    unsigned int numNames = 0, len = 0;
+    unsigned int prefixPos = 0;
+
+    //Strip the {name} annotations, so what's left is a plain format for compileFormat.
+    sf->style = style;
+    for (unsigned int i = 0; fmt[i]; i++) {
+        if (len + 1 >= STRUCTURED_MAX_FORMAT) {
+            return -1;
+        }
+        sf->fmt[len++] = fmt[i];
+        if (fmt[i] != '%') {
+            continue;
+        }
+        if (fmt[i + 1] == '%') {
+            sf->fmt[len++] = fmt[++i];
+            continue;
+        }
+        if (numNames == MAX_FORMAT_SEGMENTS) {
+            return -1;
+        }
+        names[numNames][0] = '\0';
+        if (fmt[i + 1] == '{') {
+            const char *end = strchr(fmt + i + 2, '}');
+            if (!end || end - (fmt + i + 2) >= STRUCTURED_MAX_NAME) {
+                return -1;
+            }
+            memcpy(names[numNames], fmt + i + 2, end - (fmt + i + 2));
+            names[numNames][end - (fmt + i + 2)] = '\0';
+            if (style == STRUCTURED_LOGFMT && logfmtNeedsQuotes(names[numNames])) {
+                return -1;
+            }
+            i = end - fmt;
+        }
+        numNames++;
+    }
+    sf->fmt[len] = '\0';
+    if (compileFormat(&sf->cf, sf->fmt) < 0) {
+        return -1;
+    }
+
+    //Prepare the text that goes in front of each value, and the closing text.
+    sf->numFields = 0;
+    for (unsigned int i = 0; i < sf->cf.numSegments; i++) {
+        struct formatSegment *seg = &sf->cf.segments[i];
+        struct structuredField *field;
+        char defaultName[STRUCTURED_MAX_NAME];
+        const char *name;
+        unsigned int start = prefixPos;
+
+        if (!seg->spec) {
+            continue;
+        }
+        field = &sf->fields[sf->numFields];
+        name = names[sf->numFields];
+        if (!*name) {
+            snprintf(defaultName, sizeof (defaultName), "arg%u", sf->numFields + 1);
+            name = defaultName;
+        }
+        if (style == STRUCTURED_JSON) {
+            if (!printChar(sf->prefixes, sf->numFields ? ',' : '{', &prefixPos, sizeof (sf->prefixes))
+                || printQuoted(sf->prefixes, &prefixPos, sizeof (sf->prefixes), name, NULL) < 0
+                || !printChar(sf->prefixes, ':', &prefixPos, sizeof (sf->prefixes))) {
+                return -1;
+            }
+        } else {
+            if (sf->numFields) {
+                formatAt(sf->prefixes, &prefixPos, sizeof (sf->prefixes), " ");
+            }
+            formatAt(sf->prefixes, &prefixPos, sizeof (sf->prefixes), "%s=", name);
+            if (prefixPos >= sizeof (sf->prefixes)) {
+                return -1;
+            }
+        }
+        field->prefixStart = start;
+        field->prefixLength = prefixPos - start;
+        field->seg = seg;
+        field->plainNumber = style == STRUCTURED_JSON && seg->spec != 's' && seg->spec != 'c' && seg->spec != 'x'
+            && seg->spec != 'X' && seg->spec != 'o';
+        if (field->plainNumber) {
+            seg->ps.width = -1;
+            seg->ps.f.forcePlusMinus = 0;
+            seg->ps.f.leftPadWithZeroes = 0;
+            seg->ps.f.spacePrefixPositiveNumber = 0;
+            seg->ps.f.zeroPrefixedOrForceDecimal = 0;
+        }
+        sf->numFields++;
+    }
+    sf->prefixesLength = prefixPos;
+    return 0;
+}
+
+//Like myPrintf, returns the length the whole record would have had.
+static int printStructured(const struct structuredFormat *sf, char* output, size_t out_size, ...) {
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    size_t space = outputSpace(out_size);
+    unsigned int outPos = 0;
+    size_t overflow = 0;
+    va_list args;
+    int ret;
+
+    va_start(args, out_size);
+    ret = readArgBlock(&sf->cf, argBlock, args);
+    va_end(args);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (sf->style == STRUCTURED_JSON && sf->numFields == 0) {
+        ret = formatAtMeasured(output, &outPos, space, &overflow, "{}");
+    }
+    for (unsigned int i = 0; i < sf->numFields && ret == 0; i++) {
+        const struct structuredField *field = &sf->fields[i];
+        const struct formatSegment *seg = field->seg;
+        union printArgument arg = argBlock[seg->valueArg];
+        struct printSpecification ps = seg->ps;
+        unsigned int prefixLength = field->prefixLength;
+
+        if (prefixLength > space - outPos) {
+            prefixLength = space - outPos;
+            overflow += field->prefixLength - prefixLength;
+        }
+        memcpy(output + outPos, sf->prefixes + field->prefixStart, prefixLength);
+        outPos += prefixLength;
+
+        if (seg->widthArg >= 0 && !field->plainNumber) {
+            ps.width = (int) argBlock[seg->widthArg].i;
+        }
+        if (seg->precisionArg >= 0) {
+            ps.precision = (int) argBlock[seg->precisionArg].i;
+        }
+        if (seg->spec == 's' || seg->spec == 'c') {
+            char c[2] = {(char) arg.i, '\0'};
+            const char *s = seg->spec == 's' ? (arg.s ? arg.s : "") : c;
+            if (sf->style == STRUCTURED_JSON || logfmtNeedsQuotes(s)) {
+                ret = printQuoted(output, &outPos, space, s, &overflow);
+            } else {
+                ret = formatAtMeasured(output, &outPos, space, &overflow, "%s", s);
+            }
+        } else if (specArgType(seg->spec, ps.length) == ARG_DOUBLE && sf->style == STRUCTURED_JSON && !isfinite(arg.d)) {
+            //JSON has no inf or nan.
+            ret = formatAtMeasured(output, &outPos, space, &overflow, "null");
+        } else if (sf->style == STRUCTURED_JSON && (seg->spec == 'x' || seg->spec == 'X' || seg->spec == 'o')) {
+            //Hex and octal aren't JSON numbers, so they go in as strings.
+            printCharMeasured(output, '"', &outPos, space, &overflow);
+            ret = printArgumentMeasured(&ps, output, &outPos, space, seg->spec, arg, &overflow);
+            printCharMeasured(output, '"', &outPos, space, &overflow);
+        } else {
+            ret = printArgumentMeasured(&ps, output, &outPos, space, seg->spec, arg, &overflow);
+        }
+    }
+    if (ret == 0) {
+        ret = formatAtMeasured(output, &outPos, space, &overflow, sf->style == STRUCTURED_JSON && sf->numFields ? "}\n" : "\n");
+    }
+    terminateOutput(output, outPos, out_size);
+    return ret < 0 ? -1 : (int) (outPos + overflow);
+}
+
+int compareOutput(char *output, char* expected, const char* fmt){
+    if (strcmp(expected, output)) {
+        printf("Difference between system and myPrintf for pattern:\n%s\n", fmt);
+        printf("Expected/System:%s\nprintf.........:%s\n\n", expected, output);
+    } else {
+        printf("Correct result. Buffer: %s\n\n", output);
+    }
+    return strcmp(expected, output);
+}
+
+int testPatternWithExpected(char *buffer, size_t buffer_size, char* expected, const char* fmt, ...) {
+    //First, clear the output buffer.
+    memset(buffer, 0, sizeof (buffer));
+
+    va_list args;
+
+    va_start(args, fmt);
+    myPrintf(buffer, buffer_size, fmt, args);
+    va_end(args);
+
+    return compareOutput(buffer, expected, fmt);
+}
+
+//Checks that a buffer of buffer_size gets the same truncated output and return value from myPrintf as from snprintf.
+int testTruncated(size_t buffer_size, const char* fmt, ...) {
+    char cpuOutput[256];
+    char buffer[256];
+    char returns[64];
+    int cpuRet, ret;
+
+    va_list args;
+
+    va_start(args, fmt);
+    cpuRet = vsnprintf(cpuOutput, buffer_size, fmt, args);
+    va_end(args);
+
+    va_start(args, fmt);
+    ret = myPrintf(buffer, buffer_size, fmt, args);
+    va_end(args);
+
+    if (ret != cpuRet) {
+        snprintf(returns, sizeof (returns), "%s returned %d, expected %d", fmt, ret, cpuRet);
+        return compareOutput("", "return value", returns);
+    }
+    return compareOutput(buffer, cpuOutput, fmt);
+}
+
+//Checks what an engine printed into a buffer_size buffer, given what it prints with room to spare: it should be
+//cut short like snprintf would, and return the full length.
+int testEngineTruncated(const char* name, char* output, int ret, const char* full, size_t buffer_size) {
+    char expected[256];
+    char returns[128];
+
+    snprintf(expected, buffer_size < sizeof (expected) ? buffer_size : sizeof (expected), "%s", full);
+    if (ret != (int) strlen(full)) {
+        snprintf(returns, sizeof (returns), "%s returned %d, expected %d", name, ret, (int) strlen(full));
+        return compareOutput("", "return value", returns);
+    }
+    return compareOutput(output, expected, name);
+}
+
+//Decodes every call recorded in workload, one after the other, and compares them with expected.
+int testWorkloadReplay(FILE* workload, char* expected, const char* name) {
+    struct captureReader *replay = malloc(sizeof (struct captureReader));
+    char replayed[1024];
+    unsigned int length = 0;
+    int ret;
+
+    rewind(workload);
+    replayed[0] = '\0';
+    if (!replay || captureReaderOpen(replay, workload) < 0) {
+        free(replay);
+        return compareOutput("", "readable capture", name);
+    }
+    while (captureNext(replay) > 0 && length < sizeof (replayed)) {
+        captureDecode(replay, replayed + length, sizeof (replayed) - length);
+        length += strlen(replayed + length);
+    }
+    ret = compareOutput(replayed, expected, name);
+    captureReaderClose(replay);
+    free(replay);
+    return ret;
+}
+
+int testPattern(char *buffer, size_t buffer_size, const char* fmt, ...) {
+    char cpuOutput[buffer_size];
+
+    //First, clear the output buffer.
+    memset(buffer, 0, sizeof (buffer));
+
+    va_list args;
+
+    va_start(args, fmt);
+    vsprintf(cpuOutput, fmt, args);
+    va_end(args);
+
+    va_start(args, fmt);
+    myPrintf(buffer, buffer_size, fmt, args);
+    va_end(args);
+
+    return compareOutput(buffer, cpuOutput, fmt);
+}
+
+#ifdef PRINTF_FLOAT_VERIFY
+#include <pthread.h>
+#include <unistd.h>
+
+//Exhaustive float check: every float32 bit pattern in a range goes through each of these formats with both
+//myPrintf and vsnprintf, split across all cores.
+static const char* verifyFormats[] = {
+    "%f", "%.0f", "%.3f", "%.9f", "%e", "%.0e", "%.3e", "%.9e", "%g", "%.3g", "%.9g"
+};
+#define VERIFY_NUM_FORMATS (sizeof (verifyFormats) / sizeof (verifyFormats[0]))
+#define VERIFY_CHUNK 65536
+#define VERIFY_MAX_REPORTS 20
+
+struct floatVerify {
+    uint64_t next;
+    uint64_t end;
+    atomic_ulong mismatches[VERIFY_NUM_FORMATS];
+    atomic_uint reports;
+    pthread_mutex_t lock;
+};
+
+static int verifyFormat(char* output, size_t out_size, int useSystem, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = useSystem ? vsnprintf(output, out_size, fmt, args) : myPrintf(output, out_size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+static void* verifyFloatWorker(void *arg) {
+    struct floatVerify *v = arg;
+    char expected[128];
+    char output[128];
+
+    for (;;) {
+        //Chunks are handed out one at a time so that slow ranges (huge %f values) don't leave other cores idle.
+        uint64_t start = __atomic_fetch_add(&v->next, VERIFY_CHUNK, __ATOMIC_RELAXED);
+        uint64_t end = start + VERIFY_CHUNK < v->end ? start + VERIFY_CHUNK : v->end;
+
+        if (start >= v->end) {
+            return NULL;
+        }
+        for (uint64_t bits = start; bits < end; bits++) {
+            uint32_t pattern = (uint32_t) bits;
+            float value;
+
+            memcpy(&value, &pattern, sizeof (value));
+            for (unsigned int f = 0; f < VERIFY_NUM_FORMATS; f++) {
+                verifyFormat(expected, sizeof (expected), 1, verifyFormats[f], (double) value);
+                verifyFormat(output, sizeof (output), 0, verifyFormats[f], (double) value);
+                if (strcmp(expected, output)) {
+                    atomic_fetch_add_explicit(&v->mismatches[f], 1, memory_order_relaxed);
+                    if (atomic_fetch_add(&v->reports, 1) < VERIFY_MAX_REPORTS) {
+                        pthread_mutex_lock(&v->lock);
+                        printf("0x%08x %-5s expected %s got %s\n", pattern, verifyFormats[f], expected, output);
+                        pthread_mutex_unlock(&v->lock);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//printf_verify [START END]  checks float bit patterns START up to (not including) END, in hex, or all 2^32 of
+//them. Exits nonzero if anything differs from vsnprintf.
+int main(int argc, char** argv) {
+    static struct floatVerify v;
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    unsigned long total = 0;
+    struct timespec begin, finish;
+    double seconds;
+
+    v.next = argc == 3 ? strtoull(argv[1], NULL, 16) : 0;
+    v.end = argc == 3 ? strtoull(argv[2], NULL, 16) : 1ull << 32;
+    if (v.end > 1ull << 32 || v.next > v.end) {
+        fprintf(stderr, "usage: %s [START END]\n", argv[0]);
+        return 2;
+    }
+    numThreads = numThreads > 0 ? numThreads : 1;
+    threads = malloc(sizeof (pthread_t) * numThreads);
+    pthread_mutex_init(&v.lock, NULL);
+    printf("checking floats 0x%08llx-0x%08llx on %ld threads\n", (unsigned long long) v.next,
+           (unsigned long long) v.end, numThreads);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t count = v.end - v.next;
+    for (long t = 0; t < numThreads; t++) {
+        pthread_create(&threads[t], NULL, verifyFloatWorker, &v);
+    }
+    for (long t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    seconds = finish.tv_sec - begin.tv_sec + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+
+    for (unsigned int f = 0; f < VERIFY_NUM_FORMATS; f++) {
+        unsigned long mismatches = atomic_load(&v.mismatches[f]);
+        printf("%-5s %12lu mismatches\n", verifyFormats[f], mismatches);
+        total += mismatches;
+    }
+    printf("%llu floats in %.1f s, %.0f floats/s\n", (unsigned long long) count, seconds, count / seconds);
+    free(threads);
+    return total != 0;
+}
+#endif
+
+#if !defined(PRINTF_BENCHMARK) && !defined(PRINTF_MERGE_TOOL) && !defined(PRINTF_FUZZER) && !defined(PRINTF_FLOAT_VERIFY) \
+    && !defined(PRINTF_DIFFERENTIAL)
+int main() {
+    char buffer[1024];
+    size_t bufSize = sizeof (buffer);
+
+    printf("TODO: Add checking for end of format string while reading flags/length/precision/etc\n");
+
+    testPattern(buffer, bufSize, "hello%%, :%010.7s%s:           asdfasdf\n", "world..........", "");
+
+    testPattern(buffer, bufSize, ":%07.10s:%c:%d:%+d:%i\n", "hello", 'T', 1, 1234, -1024);
+
+    testPattern(buffer, bufSize, ":%hhd:%hd:%d:%ld:\n", 128, 32768, 65536, 4294967295);
+
+    printf("Expect the following to fail. ");
+    printf("system printf seems to grant precedence to the '0' flag, not the '-' flag.\n");
+    testPattern(buffer, bufSize, ":%-0.7d:\n", 32768);
+    //Both rules should be part of a number padding function:
+    //If the 0 flag was specified, pad with zeroes to field width, If '0' and '-' flags are both specified, ignore '0'.
+    //If a precision is specified, the '0' flag is ignored.
+
+    testPattern(buffer, bufSize, ":%hhd:%hd:%d:%ld:\n", 128, 32768, 65536, 4294967295);
+
+    //Right justified string
+    testPattern(buffer, bufSize, "^%10s^", "test");
+    //Right justified integer
+    testPattern(buffer, bufSize, "^%10d^", 10);
+    //Right justified integer with leading zeroes
+    testPattern(buffer, bufSize, "^%010d^", 10);
     //Right justified integer with leading zeroes and sign prefix
     testPattern(buffer, bufSize, "^%+010d^", 10);
     //Left justified string
@@ -934,104 +4726,2735 @@ int main() {
     //Left justified integer.
     testPattern(buffer, bufSize, "^%-10d^", 10);
 
-    //Unsigned char, short, int, long values that are just over the equivalent signed rollover.
-    testPattern(buffer, bufSize, "^%hhu^", 128);
-    testPattern(buffer, bufSize, "^%hu^", 32768);
-    testPattern(buffer, bufSize, "^%u^", (unsigned int) 2147483648);
-    testPattern(buffer, bufSize, "^%lu^", 9223372036854775808LU);
+    //Unsigned char, short, int, long values that are just over the equivalent signed rollover.
+    testPattern(buffer, bufSize, "^%hhu^", 128);
+    testPattern(buffer, bufSize, "^%hu^", 32768);
+    testPattern(buffer, bufSize, "^%u^", (unsigned int) 2147483648);
+    testPattern(buffer, bufSize, "^%lu^", 9223372036854775808LU);
+
+    //Unsigned Octal
+    testPattern(buffer, bufSize, "^%hho^", 128);
+    testPattern(buffer, bufSize, "^%ho^", 32768);
+    testPattern(buffer, bufSize, "^%o^", (unsigned int) 2147483648);
+    testPattern(buffer, bufSize, "^%lo^", 9223372036854775808LU);
+
+    //Lower-case hexadecimal
+    testPattern(buffer, bufSize, "^%hhx^", 128);
+    testPattern(buffer, bufSize, "^%hx^", 32768);
+    testPattern(buffer, bufSize, "^%x^", (unsigned int) 2147483648);
+    testPattern(buffer, bufSize, "^%lx^", 9223372036854775808LU);
+    //Upper-case hex
+    testPattern(buffer, bufSize, "^%hhx^", 128);
+    testPattern(buffer, bufSize, "^%hX^", 32768);
+    testPattern(buffer, bufSize, "^%X^", (unsigned int) 2147483648);
+    testPattern(buffer, bufSize, "^%lX^", 9223372036854775808LU);
+    //Alternate form hex
+    testPattern(buffer, bufSize, "^%#x^", 32768);
+    testPattern(buffer, bufSize, "^%#X^", 32768);
+
+    //Character
+    testPattern(buffer, bufSize, "^%c%c%c%c%c^", 'h', 'e', 'l', 'l', 'o');
+
+    //Floating point...
+    testPattern(buffer, bufSize, "^%f^", 392.65);
+    testPattern(buffer, bufSize, "^%#f^", 392.65);
+    testPattern(buffer, bufSize, "^%#.0f^", 392.0);
+    testPattern(buffer, bufSize, "^% #012.6f^", 392.0);
+    testPattern(buffer, bufSize, "^%f^", 3.9265);
+    testPattern(buffer, bufSize, "^%#.0f^", 1.0);
+    testPattern(buffer, bufSize, "^%f|%.2f|%e^", 2.0, 3.0, 100.0);
+    //Whole numbers get zeroes after the decimal point, except under %g without '#'.
+    testPattern(buffer, bufSize, "^%f|%F|%.1f|%10.2f|%.0f^", 7.0, 12.0, 0.0, 100.0, 5.0);
+    testPattern(buffer, bufSize, "^%g|%G|%.3g|%#g|%#.3g^", 100.0, 5.0, 2.0, 4.0, 8.0);
+    testPattern(buffer, bufSize, "^%.2f|%f^", -0.75, -0.0);
+    //Negative values between -1 and 0 keep their sign, and space padding goes ahead of it.
+    testPattern(buffer, bufSize, "^%12f|%12f|%-12f^", -0.0, -0.5, -0.25);
+    testPattern(buffer, bufSize, "^%012f|%+12f|% 12f^", -0.5, 0.5, 0.5);
+    testPattern(buffer, bufSize, "^%5d|%+5d|%05d^", -7, 7, -7);
+
+    //Scientific notation:
+    testPattern(buffer, bufSize, "^%#012.6e^", 3.9265);
+    testPattern(buffer, bufSize, "^%#012.6e^", 392.65);
+    testPattern(buffer, bufSize, "^%#012.6e^", -392.65);
+    //Known to fail due to accuracy issues with %f specification
+    testPattern(buffer, bufSize, "^%#012.6e^", 0.39265);
+    testPattern(buffer, bufSize, "^%#012.6e^", -0.39265);
+//    testPattern(buffer, bufSize, "^%#012.6e^", 0.0);
+
+    //Floating point inf/nan/-inf/-nan/-0 tests
+    float inf = 1.0/0.0;
+    float nan = inf/inf;
+    testPattern(buffer, bufSize, "^%f^", inf);
+    testPattern(buffer, bufSize, "^%f^", -inf);
+    testPattern(buffer, bufSize, "^%f^", nan);
+    testPattern(buffer, bufSize, "^%f^", -nan);
+    testPattern(buffer, bufSize, "^%F^", inf);
+    testPattern(buffer, bufSize, "^%F^", -inf);
+    testPattern(buffer, bufSize, "^%F^", nan);
+    testPattern(buffer, bufSize, "^%F^", -nan);
+
+    //0-precision integer corner cases:
+    testPattern(buffer, bufSize, "^%.0d^", 0);
+    testPattern(buffer, bufSize, "^%.0i^", 0);
+    testPattern(buffer, bufSize, "^%.0u^", 0);
+    testPattern(buffer, bufSize, "^%.0o^", 0);
+    testPattern(buffer, bufSize, "^%.0x^", 0);
+    testPattern(buffer, bufSize, "^%.0X^", 0);
+
+    //G/g... shortest representation of the float value.
+    testPattern(buffer, bufSize, "^%g^", 3.9265);
+    testPattern(buffer, bufSize, "^%g^", 2.0);
+    testPattern(buffer, bufSize, "^%g^", 0.000000000001);
+    testPattern(buffer, bufSize, "^%G^", 3.9265);
+    testPattern(buffer, bufSize, "^%G^", 2.0);
+    testPattern(buffer, bufSize, "^%G^", 0.000000000001);
+    testPattern(buffer, bufSize, "^%#g^", 3.9265);
+    testPattern(buffer, bufSize, "^%#g^", 2.0);
+    testPattern(buffer, bufSize, "^%#g^", 0.000000000001);
+    testPattern(buffer, bufSize, "^%#G^", 3.9265);
+    testPattern(buffer, bufSize, "^%#G^", 2.0);
+    testPattern(buffer, bufSize, "^%#G^", 0.000000000001);
+
+    //integer vector
+    int4 intV4 = {1, 2, 3, 4};
+    double4 d4 = {1.0, 2.0, 3.0, 4.0};
+    testPatternWithExpected(buffer, bufSize, "^1,2,3,4^", "^%v4i^", intV4);
+    testPatternWithExpected(buffer, bufSize, "1.00,2.00,3.00,4.00^", "%2.2v4hlf", d4);
+
+    //Positional arguments
+    testPattern(buffer, bufSize, "^%2$s %1$d^", 42, "answer");
+    testPattern(buffer, bufSize, "^%1$d %1$05d %2$x^", 7, 255);
+    testPattern(buffer, bufSize, "%% ^%3$*1$.*2$f|%3$e^", 10, 2, 3.25);
+
+    //Precompiled format
+    struct compiledFormat cf;
+    compileFormat(&cf, "^%-6s|%5.1f|%*x^");
+    printCompiled(&cf, buffer, bufSize, "ab", 2.4, 4, 255);
+    compareOutput(buffer, "^ab    |  2.4|  ff^", "^%-6s|%5.1f|%*x^");
+
+    //Multi-fragment builder
+    struct printBuilder builder;
+    builderInit(&builder, buffer, bufSize);
+    builderAppendFormat(&builder, "^id=%d", 7);
+    builderAppendLiteral(&builder, " 100%");
+    builderAppendRaw(&builder, " raw bytes", 4);
+    builderAppendFormat(&builder, " %s^", "done");
+    builderFinish(&builder);
+    compareOutput(buffer, "^id=7 100% raw done^", "builder");
+    char exact[6];
+    builderInit(&builder, exact, sizeof (exact));
+    builderAppendFormat(&builder, "%s", "abcde");
+    snprintf(buffer, bufSize, "[%s] %d", exact, builderFinish(&builder));
+    compareOutput(buffer, "[abcde] 5", "builder filled exactly");
+    builderInit(&builder, exact, sizeof (exact));
+    builderAppendFormat(&builder, "%s", "abcdef");
+    snprintf(buffer, bufSize, "[%s] %d", exact, builderFinish(&builder));
+    compareOutput(buffer, "[abcde] -1", "builder overfilled");
+
+    //Shared buffer with a multi-record transaction
+    struct sharedBuffer shared;
+    struct sharedTransaction transaction;
+    char sharedData[64] = {0};
+    sharedBufferInit(&shared, sharedData, sizeof (sharedData) - 1);
+    sharedPrintf(&shared, "^a=%d ", 1);
+    sharedBegin(&transaction, &shared);
+    sharedAppend(&transaction, "b=%d ", 2);
+    sharedAppend(&transaction, "c=%s^", "x");
+    sharedCommit(&transaction);
+    compareOutput(sharedData, "^a=1 b=2 c=x^", "shared buffer transaction");
+    //Groups and records too long to stage aren't published at all
+    int overlongCommit, overlongPrintf;
+    sharedBegin(&transaction, &shared);
+    sharedAppend(&transaction, "%700s", "x");
+    sharedAppend(&transaction, "%700s", "END");
+    overlongCommit = sharedCommit(&transaction);
+    overlongPrintf = sharedPrintf(&shared, "%300s", "y");
+    snprintf(buffer, bufSize, "%d %d %zu", overlongCommit, overlongPrintf, atomic_load(&shared.used));
+    compareOutput(buffer, "-1 -1 13", "overlong shared records");
+
+    //Fixed-layout templates
+    struct printTemplate statusTemplate;
+    char expected[1024];
+    compileTemplate(&statusTemplate, "^%08x %08X %5d|%03u %4hd %05d^");
+    printTemplate(&statusTemplate, buffer, bufSize, 0xbeef, 0xcafe, -42, 7, 70000, -42);
+    sprintf(expected, "^%08x %08X %5d|%03u %4hd %05d^", 0xbeef, 0xcafe, -42, 7, 70000, -42);
+    compareOutput(buffer, expected, "^%08x %08X %5d|%03u %4hd %05d^");
+    printTemplate(&statusTemplate, buffer, bufSize, 0xbeef, 0xcafe, -123456, 12345, 5, 42);
+    sprintf(expected, "^%08x %08X %5d|%03u %4hd %05d^", 0xbeef, 0xcafe, -123456, 12345, 5, 42);
+    compareOutput(buffer, expected, "^%08x %08X %5d|%03u %4hd %05d^ (too wide for template)");
+    char small[64];
+    int length = printTemplate(&statusTemplate, small, 12, 0xbeef, 0xcafe, -123456, 12345, 5, 42);
+    testEngineTruncated("template truncated to 12 bytes", small, length, expected, 12);
+    sprintf(expected, "^%08x %08X %5d|%03u %4hd %05d^", 0xbeef, 0xcafe, -42, 7, 70000, -42);
+    length = printTemplate(&statusTemplate, small, sizeof (small), 0xbeef, 0xcafe, -42, 7, 70000, -42);
+    testEngineTruncated("template length", small, length, expected, sizeof (small));
+
+    //Adaptive emitters, checked after warm-up and after the distribution shifts.
+    struct adaptiveFormat adaptive;
+    compileAdaptive(&adaptive, "^%d|%u|%f|%.1f^");
+    for (int i = 0; i < ADAPTIVE_WARMUP_CALLS; i++) {
+        printAdaptive(&adaptive, buffer, bufSize, -i, i, (double) i, 2.0 * i);
+    }
+    printAdaptive(&adaptive, buffer, bufSize, -1234, 9999, -7.0, 2.0);
+    compareOutput(buffer, "^-1234|9999|-7.000000|2.0^", "^%d|%u|%f|%.1f^ (specialized)");
+    printAdaptive(&adaptive, buffer, bufSize, -123456, 4000000000u, 0.5, 2.5);
+    compareOutput(buffer, "^-123456|4000000000|0.500000|2.5^", "^%d|%u|%f|%.1f^ (fallback)");
+    length = printAdaptive(&adaptive, small, 10, -1234, 9999, -7.0, 2.0);
+    testEngineTruncated("adaptive truncated to 10 bytes", small, length, "^-1234|9999|-7.000000|2.0^", 10);
+    length = printAdaptive(&adaptive, small, sizeof (small), -1234, 9999, -7.0, 2.0);
+    testEngineTruncated("adaptive length", small, length, "^-1234|9999|-7.000000|2.0^", sizeof (small));
+
+    //JIT-compiled formats, including one that runs out of space and bails out to the interpreter.
+    struct jitFormat jitted;
+    const char *jitFmt = "^request %-8s took %5.2f ms, status 0x%04x (%d retries) [ok]^";
+    jitCompile(&jitted, jitFmt);
+    printJit(&jitted, buffer, bufSize, "GET", 12.5, 0x1f, 3);
+    sprintf(expected, jitFmt, "GET", 12.5, 0x1f, 3);
+    compareOutput(buffer, expected, jitFmt);
+    printJit(&jitted, buffer, 24, "GET", 12.5, 0x1f, 3);
+    printCompiled(&jitted.cf, expected, 24, "GET", 12.5, 0x1f, 3);
+    compareOutput(buffer, expected, "JIT truncated to 24 bytes");
+    sprintf(expected, jitFmt, "GET", 12.5, 0x1f, 3);
+    length = printJit(&jitted, small, 24, "GET", 12.5, 0x1f, 3);
+    testEngineTruncated("JIT length when truncated", small, length, expected, 24);
+    length = printJit(&jitted, buffer, bufSize, "GET", 12.5, 0x1f, 3);
+    testEngineTruncated("JIT length", buffer, length, expected, bufSize);
+    jitFree(&jitted);
+
+    //Capture two processes' printf calls and merge them into one ordered stream.
+    FILE *captures[2] = {tmpfile(), tmpfile()};
+    FILE *mergedCapture = tmpfile();
+    struct captureWriter *captureWriter = malloc(sizeof (struct captureWriter));
+    struct captureReader *captureReader = malloc(sizeof (struct captureReader));
+    struct printBuilder mergedText;
+    captureWriterOpen(captureWriter, captures[0], 5);
+    captureRecord(captureWriter, 10, "a %d\n", 1);
+    captureRecord(captureWriter, 30, "b %s\n", "x");
+    captureRecord(captureWriter, 40, "a %d\n", 3);
+    captureWriterClose(captureWriter);
+    captureWriterOpen(captureWriter, captures[1], 2);
+    captureRecord(captureWriter, 20, "c %.1f\n", 2.5);
+    captureRecord(captureWriter, 40, "a %d\n", 2);
+    captureWriterClose(captureWriter);
+    rewind(captures[0]);
+    rewind(captures[1]);
+    captureMerge(captures, 2, mergedCapture);
+    rewind(mergedCapture);
+    builderInit(&mergedText, expected, sizeof (expected));
+    captureReaderOpen(captureReader, mergedCapture);
+    while (captureNext(captureReader) > 0) {
+        captureDecode(captureReader, buffer, bufSize);
+        builderAppendFormat(&mergedText, "[%u] %s", captureReader->entry.rank, buffer);
+    }
+    builderFinish(&mergedText);
+    compareOutput(expected, "[5] a 1\n[2] c 2.5\n[5] b x\n[2] a 2\n[5] a 3\n", "merged captures");
+    captureReaderClose(captureReader);
+    free(captureWriter);
+    free(captureReader);
+    fclose(captures[0]);
+    fclose(captures[1]);
+    fclose(mergedCapture);
+
+    //Aggregation instead of printing
+    struct aggregator *aggregator = malloc(sizeof (struct aggregator));
+    const char *aggregatedFmt = "step %d residual %f\n";
+    aggregatorInit(aggregator);
+    aggregateSelect(aggregator, aggregatedFmt);
+    aggregatePrintf(aggregator, buffer, bufSize, aggregatedFmt, 1, 0.5);
+    aggregatePrintf(aggregator, buffer, bufSize, aggregatedFmt, 2, 0.25);
+    aggregatePrintf(aggregator, buffer, bufSize, aggregatedFmt, 6, -3.0);
+    aggregatePrintf(aggregator, buffer, bufSize, "^not %s^", "aggregated");
+    compareOutput(buffer, "^not aggregated^", "^not %s^ (not selected)");
+    aggregateSummary(aggregator, buffer, bufSize);
+    compareOutput(buffer,
+                  "format: step %d residual %f\n"
+                  "  arg 1: count 3 min 1.000 max 6.000 mean 3.000\n"
+                  "    2^0 <= |x| < 2^1: 1\n"
+                  "    2^1 <= |x| < 2^2: 1\n"
+                  "    2^2 <= |x| < 2^3: 1\n"
+                  "  arg 2: count 3 min -3.000 max 0.500 mean -0.750\n"
+                  "    |x| < 1: 2\n"
+                  "    2^1 <= |x| < 2^2: 1\n",
+                  "aggregate summary");
+    aggregatorFree(aggregator);
+
+    //A thread alternating between aggregators keeps one shard in each, even after one is reused
+    struct aggregator *otherAggregator = malloc(sizeof (struct aggregator));
+    int aggregateFailures = 0;
+    aggregatorInit(otherAggregator);
+    aggregateSelect(otherAggregator, aggregatedFmt);
+    for (int round = 0; round < 2; round++) {
+        aggregatorInit(aggregator);
+        aggregateSelect(aggregator, aggregatedFmt);
+        for (int i = 0; i < 80; i++) {
+            aggregateFailures += aggregatePrintf(i % 2 ? otherAggregator : aggregator, buffer, bufSize, aggregatedFmt, i, 1.0) < 0;
+        }
+        if (round == 0) {
+            aggregatorFree(aggregator);
+        }
+    }
+    snprintf(buffer, bufSize, "%d failures, %u and %u shards", aggregateFailures, atomic_load(&aggregator->numShards),
+             atomic_load(&otherAggregator->numShards));
+    compareOutput(buffer, "0 failures, 1 and 1 shards", "alternating aggregators");
+    aggregatorFree(otherAggregator);
+    free(otherAggregator);
+    aggregatorFree(aggregator);
+    free(aggregator);
+
+    //Work-item line prefixes
+    setWorkItemContext(3, 7, 0);
+    workItemPrintf(buffer, bufSize, "value %d\n", 5);
+    compareOutput(buffer, "[group 3, item 7] value 5\n", "work-item prefix");
+    setWorkItemContext(3, 8, 1);
+    workItemPrintf(buffer, bufSize, "value %d\n", 6);
+    compareOutput(buffer + 21, "[group 3, item 8] value 6\n", "work-item prefix after timestamp");
+    setWorkItemContext(3, 7, 0);
+    length = workItemPrintf(small, 10, "value %d\n", 5);
+    testEngineTruncated("work-item line truncated to 10 bytes", small, length, "[group 3, item 7] value 5\n", 10);
+    length = workItemPrintf(small, 20, "value %d\n", 5);
+    testEngineTruncated("work-item line truncated to 20 bytes", small, length, "[group 3, item 7] value 5\n", 20);
+    clearWorkItemContext();
+
+    //Rate limiting
+    struct rateLimit limit;
+    rateLimitInit(&limit, "^tick %d^", 0, 2);
+    rateLimitedPrintf(&limit, buffer, bufSize, 1);
+    rateLimitedPrintf(&limit, buffer, bufSize, 2);
+    compareOutput(buffer, "^tick 2^", "^tick %d^ (within burst)");
+    rateLimitedPrintf(&limit, buffer, bufSize, 3);
+    rateLimitedPrintf(&limit, buffer, bufSize, 4);
+    compareOutput(buffer, "", "^tick %d^ (suppressed)");
+    rateLimitSummary(&limit, buffer, bufSize);
+    compareOutput(buffer, "suppressed 2 messages of \"^tick %d^\"\n", "rate limit summary");
+    //A gap whose token count would wrap around if multiplied out before dividing.
+    rateLimitInit(&limit, "^tick %d^", 1000, 2);
+    rateLimitedPrintf(&limit, buffer, bufSize, 1);
+    rateLimitedPrintf(&limit, buffer, bufSize, 2);
+    atomic_store(&limit.lastRefill, monotonicNanoseconds(1) - 18446744073709552ull);
+    rateLimitedPrintf(&limit, buffer, bufSize, 3);
+    compareOutput(buffer, "^tick 3^", "^tick %d^ (refilled after a long gap)");
+    rateLimitInit(&limit, "^tick %d^", 0, 1);
+    length = rateLimitedPrintf(&limit, small, 6, 1);
+    testEngineTruncated("rate-limited line truncated to 6 bytes", small, length, "^tick 1^", 6);
+    if (rateLimitedPrintf(&limit, small, sizeof (small), 2) != RATE_LIMITED) {
+        printf("Failed: rate-limited call not reported as RATE_LIMITED\n");
+    }
+    length = rateLimitSummary(&limit, small, 12);
+    testEngineTruncated("rate limit summary truncated to 12 bytes", small, length, "suppressed 1 messages of \"^tick %d^\"\n", 12);
+
+    //Structured records
+    struct structuredFormat *structured = malloc(sizeof (struct structuredFormat));
+    compileStructured(structured, "user %{user}s took %{ms}.1f ms (%{code}d, %x)", STRUCTURED_JSON);
+    printStructured(structured, buffer, bufSize, "a\"b", 2.5, 200, 255);
+    compareOutput(buffer, "{\"user\":\"a\\\"b\",\"ms\":2.5,\"code\":200,\"arg4\":\"ff\"}\n", "JSON record");
+    length = printStructured(structured, small, 16, "a\"b", 2.5, 200, 255);
+    testEngineTruncated("JSON record truncated to 16 bytes", small, length, buffer, 16);
+    length = printStructured(structured, small, 30, "a\"b", 2.5, 200, 255);
+    testEngineTruncated("JSON record truncated to 30 bytes", small, length, buffer, 30);
+    compileStructured(structured, "user %{user}s took %{ms}.1f ms (%{code}d)", STRUCTURED_LOGFMT);
+    printStructured(structured, buffer, bufSize, "al ice", 2.5, 200);
+    compareOutput(buffer, "user=\"al ice\" ms=2.5 code=200\n", "logfmt record");
+    compileStructured(structured, "%{n}+d %{z}05d %{f}#.0f %{w}*d %{s}-4s", STRUCTURED_JSON);
+    printStructured(structured, buffer, bufSize, 5, 7, 3.0, 6, 9, "ab");
+    compareOutput(buffer, "{\"n\":5,\"z\":7,\"f\":3,\"w\":9,\"s\":\"ab\"}\n", "JSON numbers drop width and flags");
+    if (compileStructured(structured, "%{bad key}d", STRUCTURED_LOGFMT) != -1
+        || compileStructured(structured, "%{k=v}s", STRUCTURED_LOGFMT) != -1
+        || compileStructured(structured, "%{}d", STRUCTURED_LOGFMT) != -1) {
+        printf("Failed: logfmt keys that need quoting compiled\n");
+    }
+    free(structured);
+
+    //Truncation returns the length the output would have had
+    testTruncated(8, "^%d|%s|%5.1f^", 123456, "abcdef", 2.5);
+    testTruncated(10, "^%-12s|%+d^", "left", 42);
+    testTruncated(6, "^%10x|%#X^", 255, 171);
+    testTruncated(5, "^%5d|%c%%|%.0d^", 7, 'z', 0);
+    testTruncated(12, "^%2$s %1$d^", 99, "positional");
+    testTruncated(1, "^%f^", 1.0 / 3);
+
+    //Latency guards clamp pathological widths, precisions and outputs when they're set
+    unsigned long clamps = printLimitClamps();
+    setPrintLimits(8, 3, 1 << 20);
+    testPatternWithExpected(buffer, bufSize, "^       5|0.333^", "^%20d|%.6f^", 5, 1.0 / 3);
+    setPrintLimits(0, 0, 5);
+    testPatternWithExpected(buffer, bufSize, "^hell", "^hello world^");
+    setPrintLimits(0, 0, 0);
+    snprintf(buffer, bufSize, "%lu clamps", printLimitClamps() - clamps);
+    compareOutput(buffer, "3 clamps", "print limit clamps");
+
+    //Without limits, huge widths and precisions are printed as far as the buffer goes and measured past it
+    testTruncated(64, "^%5000d|%.600f^", 1, 1.0);
+    testTruncated(32, "^%.310f|%-999999d|^", 0.0, 3);
+    testTruncated(200, "^%#.20e|%040.30f|%-30.20F^", -2.5, 0.125, 0.5);
+
+    //Chrome trace export
+    FILE *traceFile = tmpfile();
+    traceEnable(1);
+    testPatternWithExpected(buffer, bufSize, "^traced 1^", "^traced %d^", 1);
+    traceEnable(0);
+    testPatternWithExpected(buffer, bufSize, "^untraced 2^", "^untraced %d^", 2);
+    if (traceFile) {
+        long events = traceWrite(traceFile);
+        rewind(traceFile);
+        size_t traceLength = fread(expected, 1, sizeof (expected) - 1, traceFile);
+        expected[traceLength] = '\0';
+        snprintf(buffer, bufSize, "%ld events, %s", events,
+                 strstr(expected, "{\"name\":\"myPrintf\",\"ph\":\"B\"") && strstr(expected, "\"droppedEvents\":0}}")
+                 ? "valid trace" : expected);
+        compareOutput(buffer, "2 events, valid trace", "trace export");
+        fclose(traceFile);
+    }
+    traceReset();
+    traceFile = tmpfile();
+    if (traceFile) {
+        char tracedData[16];
+        struct sharedBuffer traced;
+        sharedBufferInit(&traced, tracedData, sizeof (tracedData));
+        traceEnable(1);
+        sharedPrintf(&traced, "%d", 42);
+        traceEnable(0);
+        long events = traceWrite(traceFile);
+        rewind(traceFile);
+        size_t traceLength = fread(expected, 1, sizeof (expected) - 1, traceFile);
+        expected[traceLength] = '\0';
+        traceReset();
+        snprintf(buffer, bufSize, "%ld events, %s, %s", events,
+                 strstr(expected, "{\"name\":\"publish\",\"ph\":\"E\"") ? "publish traced" : expected,
+                 atomic_load(&traceBuffers) ? "buffers kept" : "buffers freed");
+        compareOutput(buffer, "2 events, publish traced, buffers freed", "trace reset");
+        fclose(traceFile);
+    }
+
+    //Workload recording replays through any build
+    FILE *workload = tmpfile();
+    if (workload && workloadRecordStart(workload) == 0) {
+        testPatternWithExpected(buffer, bufSize, "^7 ab 0.5^", "^%d %s %.1f^", 7, "ab", 0.5);
+        testPatternWithExpected(buffer, bufSize, "^2 1^", "^%2$d %1$d^", 1, 2);
+        snprintf(expected, sizeof (expected), "%lu recorded", workloadRecordStop());
+        compareOutput(expected, "2 recorded", "workload recording");
+        testWorkloadReplay(workload, "^7 ab 0.5^^2 1^", "workload replay");
+        fclose(workload);
+    }
+
+    //A format buffer reused for another format is recorded as the new format
+    workload = tmpfile();
+    if (workload && workloadRecordStart(workload) == 0) {
+        char reusedFormat[32];
+        strcpy(reusedFormat, "%s items^");
+        testPatternWithExpected(buffer, bufSize, "some items^", reusedFormat, "some");
+        strcpy(reusedFormat, "%d items^");
+        testPatternWithExpected(buffer, bufSize, "42 items^", reusedFormat, 42);
+        workloadRecordStop();
+        testWorkloadReplay(workload, "some items^42 items^", "workload replay of a reused format buffer");
+        fclose(workload);
+    }
+
+    //Streaming stores
+    static _Alignas(64) char streamed[256];
+    struct streamSink sink;
+    streamSinkInit(&sink, streamed, sizeof (streamed) - 1);
+    for (int i = 0; i < 6; i++) {
+        streamPrintf(&sink, "line %d of the streamed output\n", i);
+    }
+    streamed[streamCommit(&sink)] = '\0';
+    compareOutput(streamed + 125, "4 of the streamed output\nline 5 of the streamed output\n", "streamed output tail");
+    static _Alignas(64) char streamedLong[1024];
+    streamSinkInit(&sink, streamedLong, sizeof (streamedLong) - 1);
+    streamPrintf(&sink, "<%600s>", "long");
+    streamedLong[streamCommit(&sink)] = '\0';
+    snprintf(buffer, bufSize, "%zu %s", strlen(streamedLong), streamedLong + 597);
+    compareOutput(buffer, "602 long>", "streamed line longer than the line buffer");
+
+    //Pre-faulted buffer allocation
+    struct bufferAllocation backing;
+    if (bufferAllocate(&backing, 1 << 20, BUFFER_HUGE_PAGES | BUFFER_PREFAULT) == 0) {
+        struct sharedBuffer backed;
+        sharedBufferInit(&backed, backing.data, backing.size);
+        sharedPrintf(&backed, "^%s %d^", "backed", 1);
+        backing.data[atomic_load(&backed.used)] = '\0';
+        snprintf(buffer, bufSize, "%s %s", backing.data, backing.allocated & BUFFER_PREFAULT ? "prefaulted" : "not prefaulted");
+        compareOutput(buffer, "^backed 1^ prefaulted", "buffer allocation");
+        bufferRelease(&backing);
+    }
+
+    //Aligned table output
+    double matrix[2][3] = {{1.5, -22.25, 3.3}, {100.75, 2.5, -1.5}};
+    myPrintTable(buffer, bufSize, "%.2f", &matrix[0][0], 2, 3);
+    compareOutput(buffer, "  1.50 -22.25  3.30\n100.75   2.50 -1.50\n", "%.2f table");
+
+    //Floating point hex
+    //testPattern(buffer, bufSize, "^%a^", 392.65);
+    //testPattern(buffer, bufSize, "^%#a^", 392.65);
+    //testPattern(buffer, bufSize, "^%#.0a^", 392.0);
+    //testPattern(buffer, bufSize, "^% #012.6a^", 392.0);
+    //testPattern(buffer, bufSize, "^%a^", 3.9265);
+    //testPattern(buffer, bufSize, "^%#.0a^", 1.0);
+    //testPattern(buffer, bufSize, "^%A^", 392.65);
+    //testPattern(buffer, bufSize, "^%#A^", 392.65);
+    //testPattern(buffer, bufSize, "^%#.0A^", 392.0);
+    //testPattern(buffer, bufSize, "^% #012.6A^", 392.0);
+    //testPattern(buffer, bufSize, "^%A^", 3.9265);
+    //testPattern(buffer, bufSize, "^%#.0A^", 1.0);
+
+}
+#endif
+
+#if defined(PRINTF_BENCHMARK) || defined(PRINTF_FUZZER) || defined(PRINTF_DIFFERENTIAL)
+//A single conversion with its argument, as found by the performance fuzzer. The fuzzer looks for the cases that
+//cost the most nanoseconds per output byte, and the benchmarks replay the slowest of them.
+#define FUZZ_SPECIFIERS "diuoxXcsfFeEgG"
+#define FUZZ_NUM_SPECIFIERS 14
+#define FUZZ_KEEP_PER_SPECIFIER 4
+#define FUZZ_FLAGS "-+ #0"
+#define FUZZ_DEFAULT_CORPUS "printf_fuzz.corpus"
+
+struct fuzzCase {
+    unsigned int flags;
+    int width;
+    int precision;
+    unsigned int length;
+    char spec;
+    long i;
+    double d;
+    unsigned int stringLength;
+    double cost;
+    char fmt[48];
+};
+
+struct fuzzCorpus {
+    struct fuzzCase cases[FUZZ_NUM_SPECIFIERS][FUZZ_KEEP_PER_SPECIFIER];
+    unsigned int counts[FUZZ_NUM_SPECIFIERS];
+};
+
+static const char* fuzzLengths[] = {"", "h", "hh", "l"};
+static char fuzzString[4096];
+
+//Rebuilds c->fmt from its flags, width, precision, length and specifier.
+static void fuzzRender(struct fuzzCase *c) {
+    struct printBuilder b;
+
+    builderInit(&b, c->fmt, sizeof (c->fmt));
+    builderAppendLiteral(&b, "%");
+    for (unsigned int f = 0; f < 5; f++) {
+        if (c->flags & (1u << f)) {
+            builderAppendRaw(&b, &FUZZ_FLAGS[f], 1);
+        }
+    }
+    if (c->width >= 0) {
+        builderAppendFormat(&b, "%d", c->width);
+    }
+    if (c->precision >= 0) {
+        builderAppendFormat(&b, ".%d", c->precision);
+    }
+    if (strchr("diuoxX", c->spec)) {
+        builderAppendFormat(&b, "%s", fuzzLengths[c->length % 4]);
+    }
+    builderAppendRaw(&b, &c->spec, 1);
+    builderFinish(&b);
+}
+
+static int fuzzFormat(char* output, size_t out_size, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = myPrintf(output, out_size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+static char* fuzzStringArgument(const struct fuzzCase *c) {
+    if (!fuzzString[0]) {
+        memset(fuzzString, 'x', sizeof (fuzzString) - 1);
+    }
+    return fuzzString + sizeof (fuzzString) - 1 - c->stringLength % sizeof (fuzzString);
+}
+
+//ret = fn(..., argument of c), with the argument passed as the type c's conversion reads.
+#define FUZZ_CALL(ret, c, fn, ...) \
+    do { \
+        switch (specArgType((c)->spec, (c)->length == 3 ? l : LENGTH_DEFAULT)) { \
+            case ARG_DOUBLE: ret = fn(__VA_ARGS__, (c)->d); break; \
+            case ARG_STRING: ret = fn(__VA_ARGS__, fuzzStringArgument(c)); break; \
+            case ARG_LONG: \
+            case ARG_UNSIGNED_LONG: ret = fn(__VA_ARGS__, (c)->i); break; \
+            default: ret = fn(__VA_ARGS__, (int) (c)->i); break; \
+        } \
+    } while (0)
+
+//Formats the case once, returning the length of the output or -1.
+static int fuzzRun(const struct fuzzCase *c, char* output, size_t out_size) {
+    int ret;
+
+    FUZZ_CALL(ret, c, fuzzFormat, output, out_size, c->fmt);
+    return ret;
+}
+
+//Nanoseconds per output byte, the best of a few runs so that one interruption doesn't make a case look slow. Each
+//run times a batch of calls on the precise monotonic clock, since a single call is far shorter than a coarse
+//clock tick.
+#define FUZZ_COST_BATCH 8
+
+static double fuzzCost(const struct fuzzCase *c) {
+    static char output[16384];
+    double best = 0;
+
+    for (int run = 0; run < 3; run++) {
+        uint64_t start = monotonicNanoseconds(0);
+        int length = 0;
+        for (int call = 0; call < FUZZ_COST_BATCH && length >= 0; call++) {
+            length = fuzzRun(c, output, sizeof (output));
+        }
+        double cost = (double) (monotonicNanoseconds(0) - start) / FUZZ_COST_BATCH / (length > 0 ? length : 1);
+        if (length < 0) {
+            return -1;
+        }
+        best = run == 0 || cost < best ? cost : best;
+    }
+    return best;
+}
+
+//Keeps c if it's among the slowest few seen for its specifier. Returns 1 if it was kept.
+static int fuzzCorpusAdd(struct fuzzCorpus *corpus, const struct fuzzCase *c) {
+    const char *found = strchr(FUZZ_SPECIFIERS, c->spec);
+    unsigned int s, n, i;
+
+    if (!found || !c->spec) {
+        return 0;
+    }
+    s = found - FUZZ_SPECIFIERS;
+    n = corpus->counts[s];
+    for (i = 0; i < n; i++) {
+        if (!strcmp(corpus->cases[s][i].fmt, c->fmt) && corpus->cases[s][i].i == c->i
+            && corpus->cases[s][i].d == c->d && corpus->cases[s][i].stringLength == c->stringLength) {
+            return 0;
+        }
+    }
+    if (n == FUZZ_KEEP_PER_SPECIFIER) {
+        if (c->cost <= corpus->cases[s][n - 1].cost) {
+            return 0;
+        }
+        n--;
+    }
+    //Insertion sort, slowest first.
+    for (i = n; i > 0 && corpus->cases[s][i - 1].cost < c->cost; i--) {
+        corpus->cases[s][i] = corpus->cases[s][i - 1];
+    }
+    corpus->cases[s][i] = *c;
+    corpus->counts[s] = n + 1;
+    return 1;
+}
+
+static _Thread_local uint64_t fuzzRandomState = 0x9e3779b97f4a7c15u;
+
+static uint64_t fuzzRandom() {
+    //xorshift64
+    fuzzRandomState ^= fuzzRandomState << 13;
+    fuzzRandomState ^= fuzzRandomState >> 7;
+    fuzzRandomState ^= fuzzRandomState << 17;
+    return fuzzRandomState;
+}
+
+//Values near the edges of each argument's range, where the engine has done badly before.
+static const int fuzzWidths[] = {-1, 0, 1, 8, 64, 400, 4096, 1000000};
+static const int fuzzPrecisions[] = {-1, 0, 6, 17, 40, 308, 512, 1000000};
+static const long fuzzIntegers[] = {0, 1, -1, 9, 10, 4294967295L, -2147483648L, 9223372036854775807L};
+
+static double fuzzDouble() {
+    switch (fuzzRandom() % 6) {
+        case 0:
+            return 1.7976931348623157e308;
+        case 1:
+            return 4.9406564584124654e-324;
+        case 2:
+            return ldexp((double) fuzzRandom() / 18446744073709551616.0, (int) (fuzzRandom() % 2098) - 1074);
+        case 3:
+            return -ldexp(1.0, 1000 + (int) (fuzzRandom() % 24));
+        case 4:
+            return fuzzRandom() & 1 ? INFINITY : NAN;
+        default:
+            return (double) (long) fuzzRandom() / (1 << (fuzzRandom() % 30));
+    }
+}
+
+//Changes one thing about c: a flag, the width or precision, the length modifier, the specifier or the argument.
+static void fuzzMutate(struct fuzzCase *c) {
+    switch (fuzzRandom() % 6) {
+        case 0:
+            c->flags ^= 1u << (fuzzRandom() % 5);
+            break;
+        case 1:
+            c->width = fuzzRandom() & 1 ? fuzzWidths[fuzzRandom() % 8] : (int) (fuzzRandom() % 5000);
+            break;
+        case 2:
+            c->precision = fuzzRandom() & 1 ? fuzzPrecisions[fuzzRandom() % 8] : (int) (fuzzRandom() % 600);
+            break;
+        case 3:
+            c->length = fuzzRandom() % 4;
+            break;
+        case 4:
+            c->spec = FUZZ_SPECIFIERS[fuzzRandom() % FUZZ_NUM_SPECIFIERS];
+            break;
+        default:
+            c->i = fuzzRandom() & 1 ? fuzzIntegers[fuzzRandom() % 8] : (long) fuzzRandom();
+            c->d = fuzzDouble();
+            c->stringLength = fuzzRandom() % sizeof (fuzzString);
+            break;
+    }
+    fuzzRender(c);
+}
+
+//One case per line: flags width precision length specifier integer double(hex) string-length cost format.
+static int fuzzCorpusSave(const struct fuzzCorpus *corpus, const char* path) {
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        return -1;
+    }
+    for (unsigned int s = 0; s < FUZZ_NUM_SPECIFIERS; s++) {
+        for (unsigned int i = 0; i < corpus->counts[s]; i++) {
+            const struct fuzzCase *c = &corpus->cases[s][i];
+            fprintf(file, "%u %d %d %u %c %ld %a %u %.2f %s\n", c->flags, c->width, c->precision, c->length,
+                    c->spec, c->i, c->d, c->stringLength, c->cost, c->fmt);
+        }
+    }
+    return fclose(file) ? -1 : 0;
+}
+
+//Returns the number of cases loaded, or -1 if there's no corpus at path.
+static int fuzzCorpusLoad(struct fuzzCorpus *corpus, const char* path) {
+    FILE *file = fopen(path, "r");
+    struct fuzzCase c;
+    int loaded = 0;
+
+    memset(corpus, 0, sizeof (*corpus));
+    if (!file) {
+        return -1;
+    }
+    memset(&c, 0, sizeof (c));
+    while (fscanf(file, "%u %d %d %u %c %ld %la %u %lf %*[^\n]", &c.flags, &c.width, &c.precision, &c.length,
+                  &c.spec, &c.i, &c.d, &c.stringLength, &c.cost) == 9) {
+        fuzzRender(&c);
+        loaded += fuzzCorpusAdd(corpus, &c);
+    }
+    fclose(file);
+    return loaded;
+}
+#endif
+
+#ifdef PRINTF_BENCHMARK
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Results collected across runs for bench-compare: one ns/iter sample per benchmark per run.
+#define BENCH_MAX_RESULTS 256
+#define BENCH_MAX_RUNS 32
+
+struct benchResult {
+    char name[64];
+    unsigned int numSamples;
+    double samples[BENCH_MAX_RUNS];
+};
+
+struct benchResults {
+    unsigned int numResults;
+    struct benchResult results[BENCH_MAX_RESULTS];
+};
+
+static struct benchResults *benchCollecting;
+
+static struct benchResult* benchResultFor(struct benchResults *br, const char* name) {
+    for (unsigned int i = 0; i < br->numResults; i++) {
+        if (!strncmp(br->results[i].name, name, sizeof (br->results[i].name) - 1)) {
+            return &br->results[i];
+        }
+    }
+    if (br->numResults == BENCH_MAX_RESULTS) {
+        return NULL;
+    }
+    struct benchResult *r = &br->results[br->numResults++];
+    snprintf(r->name, sizeof (r->name), "%s", name);
+    r->numSamples = 0;
+    return r;
+}
+
+static void benchReport(const char* name, unsigned int iterations, double seconds, size_t bytes) {
+    if (benchCollecting) {
+        struct benchResult *r = benchResultFor(benchCollecting, name);
+        if (r && r->numSamples < BENCH_MAX_RUNS) {
+            r->samples[r->numSamples++] = seconds * 1e9 / iterations;
+        }
+    }
+    if (bytes) {
+        printf("%-44s %14.1f ns/iter %10.1f MB/s\n", name, seconds * 1e9 / iterations, bytes / seconds / 1e6);
+    } else {
+        printf("%-44s %14.1f ns/iter\n", name, seconds * 1e9 / iterations);
+    }
+}
+
+//Table output: single-pass myPrintTable versus the usual measure-then-print double pass with snprintf.
+static void benchTable() {
+    const unsigned int rows = 1000, cols = 100, iterations = 5;
+    size_t outSize = (size_t) rows * cols * 32;
+    double *values = malloc(sizeof (double) * rows * cols);
+    char *output = malloc(outSize);
+    unsigned int widths[100];
+    size_t bytes = 0;
+    double start;
+
+    srand(1);
+    for (unsigned int i = 0; i < rows * cols; i++) {
+        values[i] = (rand() - RAND_MAX / 2) / (double) (1 << (rand() % 20));
+    }
+
+    start = benchNow();
+    for (unsigned int iter = 0; iter < iterations; iter++) {
+        bytes += myPrintTable(output, outSize, "%.3f", values, rows, cols);
+    }
+    benchReport("table 1000x100 %.3f myPrintTable", iterations, benchNow() - start, bytes);
+
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int iter = 0; iter < iterations; iter++) {
+        char cell[64];
+        size_t pos = 0;
+        memset(widths, 0, sizeof (widths));
+        for (unsigned int i = 0; i < rows * cols; i++) {
+            unsigned int len = snprintf(cell, sizeof (cell), "%.3f", values[i]);
+            if (len > widths[i % cols]) widths[i % cols] = len;
+        }
+        for (unsigned int i = 0; i < rows * cols; i++) {
+            pos += snprintf(output + pos, outSize - pos, "%*.3f%c", widths[i % cols], values[i], i % cols == cols - 1 ? '\n' : ' ');
+        }
+        bytes += pos;
+    }
+    benchReport("table 1000x100 %.3f snprintf two-pass", iterations, benchNow() - start, bytes);
+
+    free(values);
+    free(output);
+}
+
+static int benchPrintf(char* output, size_t out_size, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = myPrintf(output, out_size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+//Positional arguments: sequential parsing versus per-call compilation versus a format compiled once.
+static void benchPositional() {
+    const unsigned int iterations = 200000;
+    char output[256];
+    struct compiledFormat cf;
+    double start;
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "%d %s %x %.2f\n", i, "name", i * 7, i * 0.25);
+    }
+    benchReport("sequential %d %s %x %.2f myPrintf", iterations, benchNow() - start, (size_t) iterations * strlen(output));
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "%4$.2f %3$x %2$s %1$d\n", i, "name", i * 7, i * 0.25);
+    }
+    benchReport("positional %4$.2f %3$x %2$s %1$d myPrintf", iterations, benchNow() - start, (size_t) iterations * strlen(output));
+
+    compileFormat(&cf, "%4$.2f %3$x %2$s %1$d\n");
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        printCompiled(&cf, output, sizeof (output), i, "name", i * 7, i * 0.25);
+    }
+    benchReport("positional precompiled printCompiled", iterations, benchNow() - start, (size_t) iterations * strlen(output));
+}
+
+//Assembling one line out of several fragments.
+static void benchBuilder() {
+    const unsigned int iterations = 200000;
+    char output[256];
+    double start;
+    size_t bytes = 0;
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        struct printBuilder b;
+        builderInit(&b, output, sizeof (output));
+        builderAppendFormat(&b, "[%u] ", i);
+        builderAppendLiteral(&b, "status: ");
+        builderAppendFormat(&b, "%x", i * 13);
+        builderAppendRaw(&b, " | ", 3);
+        builderAppendFormat(&b, "%s=%d\n", "count", i & 1023);
+        bytes += builderFinish(&b);
+    }
+    benchReport("5 fragments printBuilder", iterations, benchNow() - start, bytes);
+
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        size_t pos = 0;
+        pos += snprintf(output + pos, sizeof (output) - pos, "[%u] ", i);
+        pos += snprintf(output + pos, sizeof (output) - pos, "status: ");
+        pos += snprintf(output + pos, sizeof (output) - pos, "%x", i * 13);
+        pos += snprintf(output + pos, sizeof (output) - pos, " | ");
+        pos += snprintf(output + pos, sizeof (output) - pos, "%s=%d\n", "count", i & 1023);
+        bytes += pos;
+    }
+    benchReport("5 fragments chained snprintf", iterations, benchNow() - start, bytes);
+
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        size_t pos = 0;
+        benchPrintf(output + pos, sizeof (output) - pos, "[%u] ", i);
+        pos += strlen(output + pos);
+        benchPrintf(output + pos, sizeof (output) - pos, "status: ");
+        pos += strlen(output + pos);
+        benchPrintf(output + pos, sizeof (output) - pos, "%x", i * 13);
+        pos += strlen(output + pos);
+        benchPrintf(output + pos, sizeof (output) - pos, " | ");
+        pos += strlen(output + pos);
+        benchPrintf(output + pos, sizeof (output) - pos, "%s=%d\n", "count", i & 1023);
+        pos += strlen(output + pos);
+        bytes += pos;
+    }
+    benchReport("5 fragments chained myPrintf+strlen", iterations, benchNow() - start, bytes);
+}
+
+//Fixed-width status lines: template patching versus full formatting.
+static void benchTemplate() {
+    const unsigned int iterations = 500000;
+    const char *fmt = "%08x %08x %5d\n";
+    struct printTemplate t;
+    char output[64];
+    double start;
+
+    compileTemplate(&t, fmt);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        printTemplate(&t, output, sizeof (output), i * 2654435761u, i, (int) (i % 20000) - 10000);
+    }
+    benchReport("status line %08x %08x %5d printTemplate", iterations, benchNow() - start, (size_t) iterations * t.length);
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), fmt, i * 2654435761u, i, (int) (i % 20000) - 10000);
+    }
+    benchReport("status line %08x %08x %5d myPrintf", iterations, benchNow() - start, (size_t) iterations * t.length);
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        snprintf(output, sizeof (output), fmt, i * 2654435761u, i, (int) (i % 20000) - 10000);
+    }
+    benchReport("status line %08x %08x %5d snprintf", iterations, benchNow() - start, (size_t) iterations * t.length);
+}
+
+static void benchAdaptiveReport(const char* name, struct adaptiveFormat *af) {
+    printf("  %s chose:", name);
+    for (unsigned int i = 0; i < af->cf.numSegments; i++) {
+        if (af->cf.segments[i].spec) {
+            printf(" %%%c=%s", af->cf.segments[i].spec, emitterNames[af->segs[i].variant]);
+        }
+    }
+    printf("\n");
+}
+
+//Adaptive emitters against the plain compiled format, on data that suits them and on data that shifts halfway.
+static void benchAdaptive() {
+    const unsigned int iterations = 500000;
+    const char *fmt = "id=%d count=%u value=%f\n";
+    struct compiledFormat cf;
+    struct adaptiveFormat af;
+    char output[128];
+    double start, compiledTime, adaptiveTime;
+
+    compileFormat(&cf, fmt);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        printCompiled(&cf, output, sizeof (output), (int) (i % 2000) - 1000, i % 10000, (double) (i % 500));
+    }
+    compiledTime = benchNow() - start;
+    benchReport("small ints/integral doubles printCompiled", iterations, compiledTime, (size_t) iterations * 32);
+
+    compileAdaptive(&af, fmt);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        printAdaptive(&af, output, sizeof (output), (int) (i % 2000) - 1000, i % 10000, (double) (i % 500));
+    }
+    adaptiveTime = benchNow() - start;
+    benchReport("small ints/integral doubles printAdaptive", iterations, adaptiveTime, (size_t) iterations * 32);
+    benchAdaptiveReport("steady", &af);
+    printf("  speedup %.2fx\n", compiledTime / adaptiveTime);
+
+    //Same format, but the values outgrow the chosen emitters halfway through.
+    compileAdaptive(&af, fmt);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        if (i < iterations / 2) {
+            printAdaptive(&af, output, sizeof (output), (int) (i % 2000) - 1000, i % 10000, (double) (i % 500));
+        } else {
+            printAdaptive(&af, output, sizeof (output), (int) i * 7919, i * 104729u, i * 0.001);
+        }
+    }
+    adaptiveTime = benchNow() - start;
+    benchReport("shifting distribution printAdaptive", iterations, adaptiveTime, (size_t) iterations * 32);
+    benchAdaptiveReport("after shift", &af);
+}
+
+//Interpreted compiled formats against their JIT-compiled code.
+static void benchJit() {
+    const unsigned int iterations = 500000;
+    const char *formats[] = {
+        "[kernel] work-item %u finished in %u cycles\n",
+        "status: %08x flags: %04x count: %d\n",
+        "buffer %s: %u of %u bytes used\n",
+    };
+    char output[128];
+
+    for (unsigned int f = 0; f < sizeof (formats) / sizeof (formats[0]); f++) {
+        struct jitFormat jf;
+        char name[64];
+        double start;
+
+        jitCompile(&jf, formats[f]);
+        start = benchNow();
+        for (unsigned int i = 0; i < iterations; i++) {
+            if (f == 2) printCompiled(&jf.cf, output, sizeof (output), "capture", i, 4096u);
+            else printCompiled(&jf.cf, output, sizeof (output), i, i * 3, i & 255);
+        }
+        snprintf(name, sizeof (name), "top format %u interpreter", f);
+        benchReport(name, iterations, benchNow() - start, (size_t) iterations * strlen(output));
+
+        start = benchNow();
+        for (unsigned int i = 0; i < iterations; i++) {
+            if (f == 2) printJit(&jf, output, sizeof (output), "capture", i, 4096u);
+            else printJit(&jf, output, sizeof (output), i, i * 3, i & 255);
+        }
+        snprintf(name, sizeof (name), "top format %u %s", f, jf.code ? "JIT" : "JIT (unavailable, interpreter)");
+        benchReport(name, iterations, benchNow() - start, (size_t) iterations * strlen(output));
+        jitFree(&jf);
+    }
+}
+
+//Merging 64 captures. Each capture is about PRINTF_BENCH_MERGE_MB / 64 MB (64 MB total by default), written to
+//$TMPDIR first.
+static void benchMerge() {
+    const unsigned int numInputs = 64;
+    const char *env = getenv("PRINTF_BENCH_MERGE_MB");
+    const char *tmpdir = getenv("TMPDIR");
+    size_t totalBytes = (size_t) (env ? atol(env) : 64) << 20;
+    FILE *inputs[64], *output;
+    struct captureWriter *w = malloc(sizeof (*w));
+    char path[4096];
+    size_t inputBytes = 0;
+    long merged;
+    double start;
+
+    for (unsigned int f = 0; f < numInputs; f++) {
+        const char *formats[] = {"rank %d step %u: residual %e\n", "[%s] buffer %u/%u\n", "done %x\n"};
+        snprintf(path, sizeof (path), "%s/printf_bench_merge_%u.cap", tmpdir ? tmpdir : "/tmp", f);
+        inputs[f] = fopen(path, "w+b");
+        if (!inputs[f]) {
+            printf("merge benchmark: can't create %s\n", path);
+            return;
+        }
+        unlink(path);
+        captureWriterOpen(w, inputs[f], f);
+        for (uint64_t i = 0; ftell(inputs[f]) < (long) (totalBytes / numInputs); i++) {
+            uint64_t timestamp = i * numInputs * 4 + (f * 7 + i * 13) % (numInputs * 4);
+            switch (i % 3) {
+                case 0: captureRecord(w, timestamp, formats[0], f, (unsigned int) i, i * 1e-3); break;
+                case 1: captureRecord(w, timestamp, formats[1], "staging", (unsigned int) i, 4096u); break;
+                case 2: captureRecord(w, timestamp, formats[2], (unsigned int) i); break;
+            }
+        }
+        captureWriterClose(w);
+        inputBytes += ftell(inputs[f]);
+        rewind(inputs[f]);
+    }
+
+    output = tmpfile();
+    start = benchNow();
+    merged = captureMerge(inputs, numInputs, output);
+    fflush(output);
+    benchReport("merge 64 captures (MB/s of input)", 1, benchNow() - start, inputBytes);
+    printf("  %ld records, %.1f MB in\n", merged, inputBytes / 1e6);
+
+    for (unsigned int f = 0; f < numInputs; f++) {
+        fclose(inputs[f]);
+    }
+    fclose(output);
+    free(w);
+}
+
+//Lines with a "[group x, item y] " prefix, from the cached prefix versus formatting it every time.
+static void benchWorkItemPrefix() {
+    const unsigned int iterations = 500000;
+    char output[128];
+    size_t bytes = 0;
+    double start;
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "[group %u, item %u] x=%d\n", i / 256, i % 256, (int) i);
+        bytes += strlen(output);
+    }
+    benchReport("work-item prefix formatted per line", iterations, benchNow() - start, bytes);
+
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        if (i % 256 == 0) {
+            setWorkItemContext(i / 256, 0, 0);
+        }
+        workItemPrintf(output, sizeof (output), "x=%d\n", (int) i);
+        bytes += strlen(output);
+    }
+    benchReport("work-item prefix cached", iterations, benchNow() - start, bytes);
+
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        if (i % 256 == 0) {
+            setWorkItemContext(i / 256, 0, 1);
+        }
+        workItemPrintf(output, sizeof (output), "x=%d\n", (int) i);
+        bytes += strlen(output);
+    }
+    benchReport("work-item prefix cached with timestamp", iterations, benchNow() - start, bytes);
+    clearWorkItemContext();
+}
+
+//A suppressed rate-limited call, next to one that gets through and a plain myPrintf.
+static void benchRateLimit() {
+    const unsigned int iterations = 5000000;
+    struct rateLimit rl;
+    char output[128];
+    double start;
+
+    rateLimitInit(&rl, "flood %d %s %f\n", 1, 1);
+    rateLimitedPrintf(&rl, output, sizeof (output), 0, "x", 0.5);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        rateLimitedPrintf(&rl, output, sizeof (output), (int) i, "x", 0.5);
+    }
+    benchReport("rate limited call (suppressed)", iterations, benchNow() - start, 0);
+
+    rateLimitInit(&rl, "flood %d %s %f\n", 1, 1 << 30);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations / 10; i++) {
+        rateLimitedPrintf(&rl, output, sizeof (output), (int) i, "x", 0.5);
+    }
+    benchReport("rate limited call (allowed)", iterations / 10, benchNow() - start, 0);
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations / 10; i++) {
+        benchPrintf(output, sizeof (output), "flood %d %s %f\n", (int) i, "x", 0.5);
+    }
+    benchReport("myPrintf", iterations / 10, benchNow() - start, 0);
+}
+
+//Getting fields out of a record: printStructured straight to JSON, versus printing text and then pulling the
+//fields back out with a regex.
+static void benchStructured() {
+    const unsigned int iterations = 200000;
+    struct structuredFormat *sf = malloc(sizeof (*sf));
+    char output[256];
+    regmatch_t matches[4];
+    regex_t regex;
+    size_t bytes = 0;
+    double start, sink = 0;
+
+    compileStructured(sf, "user=%{user}s id=%{id}d latency=%{latency}f\n", STRUCTURED_JSON);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        printStructured(sf, output, sizeof (output), "alice", (int) i, i * 0.125);
+        bytes += strlen(output);
+    }
+    benchReport("printStructured JSON", iterations, benchNow() - start, bytes);
+
+    regcomp(&regex, "user=([^ ]*) id=([0-9-]+) latency=([0-9.eE+-]+)", REG_EXTENDED);
+    bytes = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "user=%s id=%d latency=%f\n", "alice", (int) i, i * 0.125);
+        bytes += strlen(output);
+        if (regexec(&regex, output, 4, matches, 0) == 0) {
+            sink += strtol(output + matches[2].rm_so, NULL, 10) + strtod(output + matches[3].rm_so, NULL);
+        }
+    }
+    benchReport("myPrintf + regex parse", iterations, benchNow() - start, bytes);
+    regfree(&regex);
+    free(sf);
+    if (sink < 0) {
+        printf("%f\n", sink);
+    }
+}
+
+#define BENCH_AGGREGATE_THREADS 4
+
+struct benchAggregateArgs {
+    struct aggregator *agg;
+    const char *fmt;
+    unsigned int iterations;
+};
+
+static void* benchAggregateProducer(void* arg) {
+    struct benchAggregateArgs *a = arg;
+    char output[128];
+
+    for (unsigned int i = 0; i < a->iterations; i++) {
+        aggregatePrintf(a->agg, output, sizeof (output), a->fmt, (int) i, i * 1e-3, i & 1023u);
+    }
+    return NULL;
+}
+
+//Producer cost of aggregating a format's arguments versus formatting them, with several threads at once.
+static void benchAggregate() {
+    const unsigned int iterations = 500000;
+    struct aggregator *agg = malloc(sizeof (*agg));
+    const char *fmt = "step %d residual %f bucket %u\n";
+    char summary[8192];
+
+    for (int aggregate = 0; aggregate <= 1; aggregate++) {
+        pthread_t threads[BENCH_AGGREGATE_THREADS];
+        struct benchAggregateArgs args = {agg, fmt, iterations};
+        double start;
+
+        aggregatorInit(agg);
+        if (aggregate) {
+            aggregateSelect(agg, fmt);
+        }
+        start = benchNow();
+        for (unsigned int t = 0; t < BENCH_AGGREGATE_THREADS; t++) {
+            pthread_create(&threads[t], NULL, benchAggregateProducer, &args);
+        }
+        for (unsigned int t = 0; t < BENCH_AGGREGATE_THREADS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        benchReport(aggregate ? "4 threads aggregatePrintf (aggregated)" : "4 threads aggregatePrintf (formatted)",
+                    iterations * BENCH_AGGREGATE_THREADS, benchNow() - start, 0);
+        if (aggregate) {
+            aggregateSummary(agg, summary, sizeof (summary));
+            printf("  summary is %zu bytes\n", strlen(summary));
+        }
+        aggregatorFree(agg);
+    }
+    free(agg);
+}
+
+#define BENCH_SHARED_THREADS 4
+#define BENCH_SHARED_GROUPS 50000
+
+struct benchSharedArgs {
+    struct sharedBuffer *buf;
+    unsigned int thread;
+    int useTransactions;
+};
+
+static void* benchSharedProducer(void* arg) {
+    struct benchSharedArgs *a = arg;
+
+    for (unsigned int group = 0; group < BENCH_SHARED_GROUPS; group++) {
+        if (a->useTransactions) {
+            struct sharedTransaction t;
+            sharedBegin(&t, a->buf);
+            sharedAppend(&t, "thread %u group %u:\n", a->thread, group);
+            for (unsigned int i = 0; i < 4; i++) {
+                sharedAppend(&t, "  detail %u = %x\n", i, group * i);
+            }
+            sharedCommit(&t);
+        } else {
+            sharedPrintf(a->buf, "thread %u group %u:\n", a->thread, group);
+            for (unsigned int i = 0; i < 4; i++) {
+                sharedPrintf(a->buf, "  detail %u = %x\n", i, group * i);
+            }
+        }
+    }
+    return NULL;
+}
+
+//A header plus four detail lines from several threads at once: one reservation per line versus one per group.
+static void benchShared() {
+    size_t size = (size_t) BENCH_SHARED_THREADS * BENCH_SHARED_GROUPS * 160;
+    struct sharedBuffer buf;
+    char *data = malloc(size);
+
+    for (int useTransactions = 0; useTransactions <= 1; useTransactions++) {
+        pthread_t threads[BENCH_SHARED_THREADS];
+        struct benchSharedArgs args[BENCH_SHARED_THREADS];
+        double start;
+
+        sharedBufferInit(&buf, data, size);
+        start = benchNow();
+        for (unsigned int t = 0; t < BENCH_SHARED_THREADS; t++) {
+            args[t].buf = &buf;
+            args[t].thread = t;
+            args[t].useTransactions = useTransactions;
+            pthread_create(&threads[t], NULL, benchSharedProducer, &args[t]);
+        }
+        for (unsigned int t = 0; t < BENCH_SHARED_THREADS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        benchReport(useTransactions ? "4 threads x 5 lines, one transaction" : "4 threads x 5 lines, per-line reservation",
+                    BENCH_SHARED_THREADS * BENCH_SHARED_GROUPS, benchNow() - start, atomic_load(&buf.used));
+    }
+    free(data);
+}
+
+static void benchUndersized() {
+    const unsigned int iterations = 200000;
+    const char* fmt = "%s: %d requests, %.3f ms average, %x flags\n";
+    const char* name = "frontend-upstream-connection-pool";
+    char output[256];
+    size_t total = 0;
+    double start;
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        total += benchPrintf(output, sizeof (output), fmt, name, i, i * 0.125, i * 7);
+    }
+    benchReport("fits in 256 bytes myPrintf", iterations, benchNow() - start, total);
+
+    total = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        total += benchPrintf(output, 16, fmt, name, i, i * 0.125, i * 7);
+    }
+    benchReport("truncated to 16 bytes myPrintf", iterations, benchNow() - start, total);
+
+    total = 0;
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        total += snprintf(output, 16, fmt, name, i, i * 0.125, i * 7);
+    }
+    benchReport("truncated to 16 bytes snprintf", iterations, benchNow() - start, total);
+}
+
+//Average and worst-case time for a format whose width or precision asks for far more than the buffer holds.
+static void benchPathological(const char* name, const char* fmt, int value, double fvalue) {
+    const unsigned int iterations = 20000;
+    char output[64];
+    double worst = 0, start, total = 0;
+
+    for (unsigned int i = 0; i < iterations; i++) {
+        start = benchNow();
+        benchPrintf(output, sizeof (output), fmt, value, fvalue);
+        start = benchNow() - start;
+        total += start;
+        worst = start > worst ? start : worst;
+    }
+    benchReport(name, iterations, total, 0);
+    printf("  worst call %.1f us\n", worst * 1e6);
+}
+
+//No limits are set, so these show the work staying bounded by the buffer rather than by the format.
+static void benchLatencyGuards() {
+    benchPathological("ordinary %8d %.3f into 64 bytes", "%8d %.3f", 12345, 2.5);
+    benchPathological("%999999999d %f into 64 bytes", "%999999999d %f", 12345, 2.5);
+    benchPathological("%d %.1000000f into 64 bytes", "%d %.1000000f", 12345, 2.5);
+    benchPathological("%-999999999d %f into 64 bytes", "%-999999999d %f", 12345, 2.5);
+}
+
+//Replays the slowest cases the performance fuzzer has found (make fuzz), from PRINTF_FUZZ_CORPUS or the default
+//corpus in the current directory.
+static void benchFuzzCorpus() {
+    const unsigned int iterations = 2000;
+    const char *path = getenv("PRINTF_FUZZ_CORPUS");
+    struct fuzzCorpus *corpus = malloc(sizeof (*corpus));
+    char *output = malloc(16384);
+    char name[64];
+
+    if (!path) {
+        path = FUZZ_DEFAULT_CORPUS;
+    }
+    if (!corpus || !output || fuzzCorpusLoad(corpus, path) < 0) {
+        printf("no fuzz corpus at %s, run make fuzz to find slow cases\n", path);
+    } else {
+        for (unsigned int s = 0; s < FUZZ_NUM_SPECIFIERS; s++) {
+            for (unsigned int i = 0; i < corpus->counts[s]; i++) {
+                const struct fuzzCase *c = &corpus->cases[s][i];
+                size_t bytes = 0;
+                double start = benchNow();
+                for (unsigned int iter = 0; iter < iterations; iter++) {
+                    bytes += fuzzRun(c, output, 16384);
+                }
+                snprintf(name, sizeof (name), "fuzz %s myPrintf", c->fmt);
+                benchReport(name, iterations, benchNow() - start, bytes);
+            }
+        }
+    }
+    free(output);
+    free(corpus);
+}
+
+//Hardware counters for the benchmarks, read through perf_event_open when PRINTF_BENCH_COUNTERS is set. Any
+//counter the kernel or the machine won't give us (containers, perf_event_paranoid, VMs) is reported as n/a.
+//Instructions are grouped with cycles so that IPC comes from the same stretch of time. When the kernel has to
+//multiplex the counters, each one is scaled up by how long it was enabled over how long it actually ran, and
+//the report says so.
+typedef enum BENCH_COUNTER {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    NUM_COUNTERS
+} benchCounter;
+
+struct benchCounters {
+    int fds[NUM_COUNTERS];
+    uint64_t values[NUM_COUNTERS];
+    //Whether any counter only ran for part of the measurement.
+    int multiplexed;
+};
+
+//Opens a counter, in groupFd's group unless that's -1.
+static int benchOpenCounter(uint32_t type, uint64_t config, int groupFd) {
+#if defined(__linux__)
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+#else
+    return -1;
+#endif
+}
+
+//Returns 0 if at least one counter could be opened.
+static int benchCountersOpen(struct benchCounters *bc) {
+    int opened = 0;
+
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        bc->fds[i] = -1;
+    }
+    if (!getenv("PRINTF_BENCH_COUNTERS")) {
+        return -1;
+    }
+#if defined(__linux__)
+    bc->fds[COUNTER_CYCLES] = benchOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    bc->fds[COUNTER_INSTRUCTIONS] = benchOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, bc->fds[COUNTER_CYCLES]);
+    if (bc->fds[COUNTER_INSTRUCTIONS] < 0 && bc->fds[COUNTER_CYCLES] >= 0) {
+        bc->fds[COUNTER_INSTRUCTIONS] = benchOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1);
+    }
+    bc->fds[COUNTER_BRANCH_MISSES] = benchOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1);
+    bc->fds[COUNTER_L1D_MISSES] = benchOpenCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+        | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, -1);
+    bc->fds[COUNTER_LLC_MISSES] = benchOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1);
+#endif
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        opened |= bc->fds[i] >= 0;
+    }
+    return opened ? 0 : -1;
+}
+
+static void benchCountersClose(struct benchCounters *bc) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (bc->fds[i] >= 0) {
+            close(bc->fds[i]);
+        }
+    }
+}
+
+static void benchCountersStart(struct benchCounters *bc) {
+#if defined(__linux__)
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (bc->fds[i] >= 0) {
+            ioctl(bc->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(bc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+static void benchCountersStop(struct benchCounters *bc) {
+#if defined(__linux__)
+    bc->multiplexed = 0;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        //The count, then the time the counter was enabled and the time it was actually counting.
+        uint64_t reading[3];
+
+        bc->values[i] = 0;
+        if (bc->fds[i] >= 0) {
+            ioctl(bc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(bc->fds[i], reading, sizeof (reading)) == sizeof (reading) && reading[2]) {
+                bc->values[i] = reading[2] < reading[1] ? (uint64_t) ((double) reading[0] * reading[1] / reading[2]) : reading[0];
+                bc->multiplexed |= reading[2] < reading[1];
+            }
+        }
+    }
+#endif
+}
+
+//Appends one counter per call, or n/a if we don't have it.
+static void benchAppendPerCall(struct printBuilder *b, const struct benchCounters *bc, benchCounter counter, const char* name, unsigned int iterations) {
+    if (bc->fds[counter] >= 0) {
+        builderAppendFormat(b, " %s %.2f", name, (double) bc->values[counter] / iterations);
+    } else {
+        builderAppendFormat(b, " %s n/a", name);
+    }
+}
+
+static void benchCountersReport(const struct benchCounters *bc, unsigned int iterations) {
+    struct printBuilder b;
+    char line[256];
+
+    builderInit(&b, line, sizeof (line));
+    if (bc->fds[COUNTER_CYCLES] >= 0 && bc->fds[COUNTER_INSTRUCTIONS] >= 0 && bc->values[COUNTER_CYCLES]) {
+        builderAppendFormat(&b, "  IPC %.2f", (double) bc->values[COUNTER_INSTRUCTIONS] / bc->values[COUNTER_CYCLES]);
+    } else {
+        builderAppendLiteral(&b, "  IPC n/a");
+    }
+    benchAppendPerCall(&b, bc, COUNTER_CYCLES, "cycles/call", iterations);
+    benchAppendPerCall(&b, bc, COUNTER_BRANCH_MISSES, "branch-misses/call", iterations);
+    benchAppendPerCall(&b, bc, COUNTER_L1D_MISSES, "L1d-misses/call", iterations);
+    benchAppendPerCall(&b, bc, COUNTER_LLC_MISSES, "LLC-misses/call", iterations);
+    if (bc->multiplexed) {
+        builderAppendLiteral(&b, " (multiplexed, scaled)");
+    }
+    if (builderFinish(&b) >= 0) {
+        printf("%s\n", line);
+    }
+}
+
+//One line per specifier family, with hardware counters underneath when they're available.
+static void benchSpecifierFamilies() {
+    static const char* families[] = {"%d", "%u", "%x", "%o", "%c", "%s", "%f", "%e", "%g"};
+    const unsigned int iterations = 200000;
+    struct benchCounters bc;
+    int haveCounters = benchCountersOpen(&bc) == 0;
+    char output[256];
+    char name[64];
+
+    if (!haveCounters && getenv("PRINTF_BENCH_COUNTERS")) {
+        printf("hardware counters unavailable, check /proc/sys/kernel/perf_event_paranoid\n");
+    }
+    for (unsigned int f = 0; f < sizeof (families) / sizeof (families[0]); f++) {
+        char spec = families[f][1];
+        size_t bytes = 0;
+        double start;
+
+        if (haveCounters) {
+            benchCountersStart(&bc);
+        }
+        start = benchNow();
+        for (unsigned int i = 0; i < iterations; i++) {
+            switch (specArgType(spec, LENGTH_DEFAULT)) {
+                case ARG_DOUBLE:
+                    bytes += benchPrintf(output, sizeof (output), families[f], ((int) i - (int) iterations / 2) * 1.0625);
+                    break;
+                case ARG_STRING:
+                    bytes += benchPrintf(output, sizeof (output), families[f], "specifier family");
+                    break;
+                default:
+                    bytes += benchPrintf(output, sizeof (output), families[f], (int) (i * 2654435761u) >> (i & 15));
+                    break;
+            }
+        }
+        double seconds = benchNow() - start;
+        if (haveCounters) {
+            benchCountersStop(&bc);
+        }
+        snprintf(name, sizeof (name), "family %s myPrintf", families[f]);
+        benchReport(name, iterations, seconds, bytes);
+        if (haveCounters) {
+            benchCountersReport(&bc, iterations);
+        }
+    }
+    if (haveCounters) {
+        benchCountersClose(&bc);
+    }
+}
+
+//What tracing costs per myPrintf call: compiled in but off, and on.
+static void benchTrace() {
+    const unsigned int iterations = 60000;
+    char output[256];
+    double start;
+
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "%d %s %x\n", i, "name", i * 7);
+    }
+    benchReport("tracing disabled myPrintf", iterations, benchNow() - start, 0);
+
+    traceEnable(1);
+    start = benchNow();
+    for (unsigned int i = 0; i < iterations; i++) {
+        benchPrintf(output, sizeof (output), "%d %s %x\n", i, "name", i * 7);
+    }
+    benchReport("tracing enabled myPrintf", iterations, benchNow() - start, 0);
+    traceEnable(0);
+    traceReset();
+}
+
+//Workload replay: re-runs a recorded workload (see workloadRecordStart) through myPrintf, glibc and the compiled
+//engine. The capture carries its own format strings, so it doesn't matter which binary recorded it.
+#define REPLAY_MAX_INTEGERS 10
+#define REPLAY_MAX_DOUBLES 8
+
+struct replayRecord {
+    uint32_t formatId;
+    char *payload;
+    union printArgument *args;
+};
+
+struct replayWorkload {
+    struct captureReader reader;
+    struct replayRecord *records;
+    size_t numRecords;
+};
+
+typedef int (*replayPrintf)(char* output, size_t out_size, const char* fmt, ...);
+
+static int replayLoad(struct replayWorkload *w, FILE* file) {
+    size_t capacity = 0;
+    int ret;
+
+    w->records = NULL;
+    w->numRecords = 0;
+    if (captureReaderOpen(&w->reader, file) < 0) {
+        return -1;
+    }
+    while ((ret = captureNext(&w->reader)) > 0) {
+        const struct compiledFormat *cf = w->reader.compiled[w->reader.entry.formatId];
+        struct replayRecord *r;
+
+        if (w->numRecords == capacity) {
+            struct replayRecord *grown = realloc(w->records, sizeof (*grown) * (capacity = capacity ? capacity * 2 : 1024));
+            if (!grown) {
+                return -1;
+            }
+            w->records = grown;
+        }
+        r = &w->records[w->numRecords];
+        r->formatId = w->reader.entry.formatId;
+        r->payload = malloc(w->reader.entry.payloadLength + 1);
+        r->args = malloc(sizeof (union printArgument) * (cf->numArgs + 1));
+        if (!r->payload || !r->args) {
+            return -1;
+        }
+        //Strings in the argument block point into the payload, so each record keeps its own copy.
+        memcpy(r->payload, w->reader.payload, w->reader.entry.payloadLength);
+        if (captureUnpackArgs(cf, r->args, r->payload, w->reader.entry.payloadLength) < 0) {
+            return -1;
+        }
+        w->numRecords++;
+    }
+    return ret;
+}
+
+static void replayFree(struct replayWorkload *w) {
+    for (size_t i = 0; i < w->numRecords; i++) {
+        free(w->records[i].payload);
+        free(w->records[i].args);
+    }
+    free(w->records);
+    captureReaderClose(&w->reader);
+}
+
+//Calls a printf-style function with a record's arguments. There's no portable way to build a va_list, so integer
+//and pointer arguments go in one run and doubles in another: under the SysV x86-64 ABI va_arg takes each class from
+//its own registers and then the stack in order, which gives back the original sequence as long as the doubles fit
+//in registers. Returns -2 for records that can't be passed that way.
+static int replayCall(replayPrintf fn, char* output, size_t out_size, const struct compiledFormat *cf, const union printArgument *args) {
+#if defined(__x86_64__) && !defined(_WIN32)
+    long g[REPLAY_MAX_INTEGERS] = {0};
+    double d[REPLAY_MAX_DOUBLES] = {0};
+    unsigned int numIntegers = 0, numDoubles = 0;
+
+    for (unsigned int i = 0; i < cf->numArgs; i++) {
+        if (cf->argTypes[i] == ARG_DOUBLE) {
+            if (numDoubles == REPLAY_MAX_DOUBLES) return -2;
+            d[numDoubles++] = args[i].d;
+        } else {
+            if (numIntegers == REPLAY_MAX_INTEGERS) return -2;
+            g[numIntegers++] = args[i].i;
+        }
+    }
+    return fn(output, out_size, cf->fmt, g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], g[8], g[9],
+              d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+#else
+    return -2;
+#endif
+}
+
+typedef enum REPLAY_ENGINE {
+    REPLAY_MYPRINTF,
+    REPLAY_GLIBC,
+    REPLAY_COMPILED,
+    REPLAY_NUM_ENGINES
+} replayEngine;
+
+static const char* replayEngineNames[REPLAY_NUM_ENGINES] = {"myPrintf", "snprintf", "compiled"};
+
+//Formats one record with one engine, returning the length or a negative value.
+static int replayOne(const struct replayWorkload *w, const struct replayRecord *r, replayEngine engine, char* output, size_t out_size) {
+    const struct compiledFormat *cf = w->reader.compiled[r->formatId];
+    unsigned int outPos = 0;
+
+    switch (engine) {
+        case REPLAY_MYPRINTF:
+            return replayCall(benchPrintf, output, out_size, cf, r->args);
+        case REPLAY_GLIBC:
+            return replayCall(snprintf, output, out_size, cf, r->args);
+        default:
+            if (formatArgBlock(cf, output, &outPos, out_size - 1, r->args) < 0) {
+                return -1;
+            }
+            output[outPos] = '\0';
+            return outPos;
+    }
+}
+
+//Total throughput for each engine replaying the workload in recorded order, then per format.
+static void benchReplayWorkload(const struct replayWorkload *w) {
+    unsigned int numFormats = w->reader.numFormats;
+    char output[4096];
+    char name[64];
+
+    for (replayEngine engine = 0; engine < REPLAY_NUM_ENGINES; engine++) {
+        size_t total = 0, skipped = 0;
+        double start = benchNow();
+
+        for (size_t i = 0; i < w->numRecords; i++) {
+            int length = replayOne(w, &w->records[i], engine, output, sizeof (output));
+            if (length >= 0) {
+                total += length;
+            } else {
+                skipped++;
+            }
+        }
+        snprintf(name, sizeof (name), "replay %zu calls %s", w->numRecords, replayEngineNames[engine]);
+        benchReport(name, w->numRecords ? w->numRecords : 1, benchNow() - start, total);
+        if (skipped) {
+            printf("  %zu calls couldn't be replayed through %s\n", skipped, replayEngineNames[engine]);
+        }
+    }
+
+    //Per format: each engine replays just that format's calls, in order.
+    for (unsigned int f = 0; f < numFormats; f++) {
+        size_t calls = 0;
+        for (size_t i = 0; i < w->numRecords; i++) {
+            calls += w->records[i].formatId == f;
+        }
+        for (replayEngine engine = 0; engine < REPLAY_NUM_ENGINES && calls; engine++) {
+            double start = benchNow();
+            size_t total = 0;
+            for (size_t i = 0; i < w->numRecords; i++) {
+                if (w->records[i].formatId == f) {
+                    int length = replayOne(w, &w->records[i], engine, output, sizeof (output));
+                    total += length > 0 ? length : 0;
+                }
+            }
+            snprintf(name, sizeof (name), "  %.24s %s", w->reader.formats[f], replayEngineNames[engine]);
+            for (char *c = name; *c; c++) {
+                *c = *c == '\n' ? ' ' : *c;
+            }
+            benchReport(name, calls, benchNow() - start, total);
+        }
+    }
+}
+
+//Replays PRINTF_BENCH_WORKLOAD if it's set. Otherwise records a small synthetic mix first and replays that, so the
+//recorder and the replay are both exercised.
+static void benchReplay() {
+    const char *path = getenv("PRINTF_BENCH_WORKLOAD");
+    struct replayWorkload *w = malloc(sizeof (*w));
+    FILE *file = path ? fopen(path, "rb") : tmpfile();
+    char output[256];
+
+    if (!w || !file) {
+        printf("can't open workload %s\n", path ? path : "(temporary)");
+        free(w);
+        return;
+    }
+    if (!path) {
+        workloadRecordStart(file);
+        for (unsigned int i = 0; i < 100000; i++) {
+            switch (i % 4) {
+                case 0:
+                    benchPrintf(output, sizeof (output), "GET %s %d %.1f ms\n", "/index.html", 200, (i % 97) * 0.5);
+                    break;
+                case 1:
+                    benchPrintf(output, sizeof (output), "worker %u queue %u\n", i % 16, i % 100);
+                    break;
+                case 2:
+                    benchPrintf(output, sizeof (output), "%s=%d\n", "retries", i % 3);
+                    break;
+                default:
+                    benchPrintf(output, sizeof (output), "ratio %.3f of %lu\n", (double) (i % 1000) / 1000, (unsigned long) i);
+                    break;
+            }
+        }
+        workloadRecordStop();
+        rewind(file);
+    }
+    if (replayLoad(w, file) < 0) {
+        printf("%s isn't a usable workload capture\n", path ? path : "recorded workload");
+    } else {
+        benchReplayWorkload(w);
+    }
+    replayFree(w);
+    free(w);
+    fclose(file);
+}
+
+//Bulk decoding into a large buffer, with ordinary stores and with streaming stores. PRINTF_BENCH_STREAM_MB sets the
+//buffer size (default 128).
+static void benchStreaming() {
+    const char *mbEnv = getenv("PRINTF_BENCH_STREAM_MB");
+    size_t size = (size_t) (mbEnv ? strtoul(mbEnv, NULL, 10) : 128) << 20;
+    char *data = aligned_alloc(STREAM_LINE_SIZE, size);
+    union printArgument argBlock[MAX_COMPILED_ARGS];
+    struct compiledFormat cf;
+    struct benchCounters bc;
+    int haveCounters = benchCountersOpen(&bc) == 0;
+
+    if (!data || compileFormat(&cf, "%d %s %.2f %x\n") < 0) {
+        free(data);
+        return;
+    }
+    //Touch every page first so that neither run pays for faulting the buffer in.
+    memset(data, 0, size);
+    for (int streaming = 0; streaming < 2; streaming++) {
+        struct streamSink sink;
+        unsigned int records = 0;
+        double start;
+
+        streamSinkInit(&sink, data, size);
+        sink.streaming &= streaming;
+        if (haveCounters) {
+            benchCountersStart(&bc);
+        }
+        start = benchNow();
+        for (;; records++) {
+            argBlock[0].i = records;
+            argBlock[1].s = records & 1 ? "odd" : "even";
+            argBlock[2].d = records * 0.25;
+            argBlock[3].u = records * 2654435761u;
+            if (streamFormatBlock(&sink, &cf, argBlock) < 0) {
+                break;
+            }
+        }
+        size_t bytes = streamCommit(&sink);
+        double seconds = benchNow() - start;
+        if (haveCounters) {
+            benchCountersStop(&bc);
+        }
+        benchReport(streaming ? "decode into buffer, streaming stores" : "decode into buffer, ordinary stores", records,
+                    seconds, bytes);
+        if (haveCounters) {
+            benchCountersReport(&bc, records);
+        }
+    }
+    if (haveCounters) {
+        benchCountersClose(&bc);
+    }
+    free(data);
+}
+
+//First-burst latency and steady-state throughput into a fresh 1 GiB shared buffer (PRINTF_BENCH_BUFFER_MB) for
+//each way of backing it.
+static void benchBufferBacking() {
+    static const struct {
+        const char *name;
+        unsigned int options;
+    } backings[] = {
+        {"plain", 0},
+        {"prefault", BUFFER_PREFAULT},
+        {"huge pages", BUFFER_HUGE_PAGES},
+        {"huge pages+prefault", BUFFER_HUGE_PAGES | BUFFER_PREFAULT},
+        {"prefault+mlock", BUFFER_PREFAULT | BUFFER_LOCK},
+    };
+    const char *mbEnv = getenv("PRINTF_BENCH_BUFFER_MB");
+    size_t size = (size_t) (mbEnv ? strtoul(mbEnv, NULL, 10) : 1024) << 20;
+    const unsigned int burst = 4096;
+    char line[64];
+    char name[64];
+
+    memset(line, 'x', sizeof (line) - 1);
+    line[sizeof (line) - 1] = '\n';
+    for (unsigned int b = 0; b < sizeof (backings) / sizeof (backings[0]); b++) {
+        struct bufferAllocation a;
+        struct sharedBuffer buf;
+        double start, worst = 0, burstTime = 0;
+        size_t lines = 0;
+
+        start = benchNow();
+        if (bufferAllocate(&a, size, backings[b].options) < 0) {
+            printf("%s: can't allocate %zu MB\n", backings[b].name, size >> 20);
+            continue;
+        }
+        printf("%-20s allocated in %.1f ms%s%s%s%s%s\n", backings[b].name, (benchNow() - start) * 1e3,
+               a.allocated ? " with" : "", a.allocated & BUFFER_HUGE_PAGES ? " hugetlb" : "",
+               a.allocated & BUFFER_TRANSPARENT_HUGE_PAGES ? " THP" : "",
+               a.allocated & BUFFER_PREFAULT ? " prefault" : "", a.allocated & BUFFER_LOCK ? " mlock" : "");
+        if ((backings[b].options & ~a.allocated & (BUFFER_PREFAULT | BUFFER_LOCK)) != 0) {
+            printf("  (fell back for some options)\n");
+        }
+
+        //First burst: formatted records straight into the fresh buffer.
+        sharedBufferInit(&buf, a.data, a.size);
+        for (unsigned int i = 0; i < burst; i++) {
+            double callStart = benchNow();
+            sharedPrintf(&buf, "burst record %u of %u at %.3f\n", i, burst, i * 0.125);
+            callStart = benchNow() - callStart;
+            burstTime += callStart;
+            worst = callStart > worst ? callStart : worst;
+        }
+        snprintf(name, sizeof (name), "first burst, %s", backings[b].name);
+        benchReport(name, burst, burstTime, atomic_load(&buf.used));
+        printf("  worst record %.1f us\n", worst * 1e6);
+
+        //Steady state: lines copied in through reservations over the whole buffer, twice, timing the second pass.
+        for (int pass = 0; pass < 2; pass++) {
+            sharedBufferInit(&buf, a.data, a.size);
+            lines = 0;
+            start = benchNow();
+            for (char *dest; (dest = sharedBufferReserve(&buf, sizeof (line))); lines++) {
+                memcpy(dest, line, sizeof (line));
+            }
+        }
+        snprintf(name, sizeof (name), "steady state, %s", backings[b].name);
+        benchReport(name, lines, benchNow() - start, lines * sizeof (line));
+        bufferRelease(&a);
+    }
+}
+
+//Parallel capture decoding, naive pool against the NUMA-aware one. The capture's pages follow the process's memory
+//policy, so run this under numactl to choose where they live, e.g. `numactl --membind=0 ./printf_bench --decode`
+//puts the whole capture on node 0 and `numactl --interleave=all` spreads it over every node (make bench-numa).
+static void benchParallelDecode() {
+    const char *mbEnv = getenv("PRINTF_BENCH_DECODE_MB");
+    size_t target = (size_t) (mbEnv ? strtoul(mbEnv, NULL, 10) : 64) << 20, size;
+    struct captureWriter *w = malloc(sizeof (*w));
+    struct parallelDecoder *naive = malloc(sizeof (*naive)), *aware = malloc(sizeof (*aware));
+    unsigned int chunksPerNode[DECODE_MAX_NODES] = {0};
+    FILE *file = tmpfile();
+    char *capture;
+
+    if (!w || !naive || !aware || !file || captureWriterOpen(w, file, 0) < 0) {
+        printf("parallel decode: can't set up\n");
+        return;
+    }
+    for (unsigned long i = 0; (size_t) ftell(file) < target; i++) {
+        switch (i % 4) {
+            case 0: captureRecord(w, i, "request %lu from %s took %.3f ms\n", i, "10.0.0.1", i * 0.001); break;
+            case 1: captureRecord(w, i, "queue depth %d, %u waiting\n", (int) (i % 97), (unsigned int) (i % 13)); break;
+            case 2: captureRecord(w, i, "checksum %08x over %lu bytes\n", (unsigned int) (i * 2654435761u), i); break;
+            default: captureRecord(w, i, "%s: %e\n", "sample", i * 1.5e-3); break;
+        }
+    }
+    captureWriterClose(w);
+    rewind(file);
+    capture = parallelDecoderLoad(file, &size);
+    fclose(file);
+    if (!capture || parallelDecoderOpen(naive, capture, size) < 0 || parallelDecoderOpen(aware, capture, size) < 0) {
+        printf("parallel decode: can't index the capture\n");
+        free(capture);
+        return;
+    }
+
+    printf("%u nodes, %u CPUs%s; %u chunks of %zu MB capture on nodes:", aware->topology.numNodes,
+           aware->topology.totalCpus,
+#if defined(PRINTF_LIBNUMA)
+           " (libnuma)",
+#else
+           "",
+#endif
+           aware->numChunks, size >> 20);
+    for (unsigned int c = 0; c < aware->numChunks; c++) {
+        chunksPerNode[aware->chunks[c].node]++;
+    }
+    for (unsigned int n = 0; n < aware->topology.numNodes; n++) {
+        printf(" %d:%u", aware->topology.nodeIds[n], chunksPerNode[n]);
+    }
+    printf("\n");
+
+    for (int repeat = 0; repeat < 2; repeat++) {
+        double start = benchNow();
+        size_t bytes = 0;
+        int ret = parallelDecode(naive, 0, 0);
+        double naiveTime = benchNow() - start;
+
+        start = benchNow();
+        ret |= parallelDecode(aware, 0, 1);
+        if (ret < 0) {
+            printf("parallel decode failed\n");
+            break;
+        }
+        //Only the second pass is reported; the first faults in the staging buffers.
+        if (repeat) {
+            double awareTime = benchNow() - start;
+            for (unsigned int c = 0; c < aware->numChunks; c++) {
+                bytes += aware->chunks[c].length;
+            }
+            benchReport("parallel decode, naive pool", naive->numRecords, naiveTime, bytes);
+            benchReport("parallel decode, NUMA-aware", aware->numRecords, awareTime, bytes);
+        }
+    }
+    for (unsigned int c = 0; c < aware->numChunks; c++) {
+        const struct decodeChunk *a = &aware->chunks[c], *b = &naive->chunks[c];
+        if (a->length != b->length || memcmp(aware->workers[a->worker].staging + a->offset,
+                                             naive->workers[b->worker].staging + b->offset, a->length)) {
+            printf("parallel decode: chunk %u differs between the pools\n", c);
+            break;
+        }
+    }
+    parallelDecoderClose(naive);
+    parallelDecoderClose(aware);
+    free(capture);
+    free(naive);
+    free(aware);
+    free(w);
+}
+
+static void benchSuite() {
+    benchSpecifierFamilies();
+    benchTable();
+    benchPositional();
+    benchBuilder();
+    //PRINTF_BENCH_TRACE=FILE writes a Chrome trace of the shared buffer benchmark.
+    if (getenv("PRINTF_BENCH_TRACE")) {
+        traceEnable(1);
+    }
+    benchShared();
+    if (getenv("PRINTF_BENCH_TRACE")) {
+        FILE *traceFile = fopen(getenv("PRINTF_BENCH_TRACE"), "w");
+        traceEnable(0);
+        if (!traceFile || traceWrite(traceFile) < 0 || fclose(traceFile)) {
+            printf("couldn't write trace to %s\n", getenv("PRINTF_BENCH_TRACE"));
+        }
+        traceReset();
+    }
+    benchTemplate();
+    benchAdaptive();
+    benchJit();
+    benchMerge();
+    benchAggregate();
+    benchWorkItemPrefix();
+    benchRateLimit();
+    benchStructured();
+    benchUndersized();
+    benchLatencyGuards();
+    benchTrace();
+    benchReplay();
+    benchStreaming();
+    benchBufferBacking();
+    benchParallelDecode();
+    benchFuzzCorpus();
+}
+
+//Baselines are JSON, one benchmark per line so they diff well:
+//{"benchmarks": [
+//{"name": "family %d myPrintf", "ns_per_iter": [221.1, 219.8, 220.4]},
+//...
+//]}
+static int benchSaveBaseline(const struct benchResults *br, const char* path) {
+    FILE *file = fopen(path, "w");
 
-    //Unsigned Octal
-    testPattern(buffer, bufSize, "^%hho^", 128);
-    testPattern(buffer, bufSize, "^%ho^", 32768);
-    testPattern(buffer, bufSize, "^%o^", (unsigned int) 2147483648);
-    testPattern(buffer, bufSize, "^%lo^", 9223372036854775808LU);
+    if (!file) {
+        return -1;
+    }
+    fprintf(file, "{\"benchmarks\": [\n");
+    for (unsigned int i = 0; i < br->numResults; i++) {
+        const struct benchResult *r = &br->results[i];
+        fputs("{\"name\": \"", file);
+        for (const char *c = r->name; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                fputc('\\', file);
+            }
+            fputc(*c, file);
+        }
+        fputs("\", \"ns_per_iter\": [", file);
+        for (unsigned int s = 0; s < r->numSamples; s++) {
+            fprintf(file, "%s%.1f", s ? ", " : "", r->samples[s]);
+        }
+        fprintf(file, "]}%s\n", i + 1 < br->numResults ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    return fclose(file) ? -1 : 0;
+}
 
-    //Lower-case hexadecimal
-    testPattern(buffer, bufSize, "^%hhx^", 128);
-    testPattern(buffer, bufSize, "^%hx^", 32768);
-    testPattern(buffer, bufSize, "^%x^", (unsigned int) 2147483648);
-    testPattern(buffer, bufSize, "^%lx^", 9223372036854775808LU);
-    //Upper-case hex
-    testPattern(buffer, bufSize, "^%hhx^", 128);
-    testPattern(buffer, bufSize, "^%hX^", 32768);
-    testPattern(buffer, bufSize, "^%X^", (unsigned int) 2147483648);
-    testPattern(buffer, bufSize, "^%lX^", 9223372036854775808LU);
-    //Alternate form hex
-    testPattern(buffer, bufSize, "^%#x^", 32768);
-    testPattern(buffer, bufSize, "^%#X^", 32768);
+//Reads a baseline written by benchSaveBaseline. Returns -1 if there's no baseline at path.
+static int benchLoadBaseline(struct benchResults *br, const char* path) {
+    FILE *file = fopen(path, "r");
+    char line[4096];
 
-    //Character
-    testPattern(buffer, bufSize, "^%c%c%c%c%c^", 'h', 'e', 'l', 'l', 'o');
+    br->numResults = 0;
+    if (!file) {
+        return -1;
+    }
+    while (fgets(line, sizeof (line), file)) {
+        char name[64];
+        unsigned int len = 0;
+        char *c = strstr(line, "{\"name\": \"");
+        struct benchResult *r;
+
+        if (!c) {
+            continue;
+        }
+        for (c += 10; *c && *c != '"' && len < sizeof (name) - 1; c++) {
+            if (*c == '\\' && c[1]) {
+                c++;
+            }
+            name[len++] = *c;
+        }
+        name[len] = '\0';
+        if (!(c = strchr(c, '[')) || !(r = benchResultFor(br, name))) {
+            continue;
+        }
+        c++;
+        while (r->numSamples < BENCH_MAX_RUNS) {
+            char *end;
+            double sample = strtod(c, &end);
+            if (end == c) {
+                break;
+            }
+            r->samples[r->numSamples++] = sample;
+            c = end + strspn(end, ", ");
+        }
+    }
+    fclose(file);
+    return 0;
+}
 
-    //Floating point...
-    testPattern(buffer, bufSize, "^%f^", 392.65);
-    testPattern(buffer, bufSize, "^%#f^", 392.65);
-    testPattern(buffer, bufSize, "^%#.0f^", 392.0);
-    testPattern(buffer, bufSize, "^% #012.6f^", 392.0);
-    testPattern(buffer, bufSize, "^%f^", 3.9265);
-    testPattern(buffer, bufSize, "^%#.0f^", 1.0);
+static int benchCompareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
 
-    //Scientific notation:
-    testPattern(buffer, bufSize, "^%#012.6e^", 3.9265);
-    testPattern(buffer, bufSize, "^%#012.6e^", 392.65);
-    testPattern(buffer, bufSize, "^%#012.6e^", -392.65);
-    //Known to fail due to accuracy issues with %f specification
-    testPattern(buffer, bufSize, "^%#012.6e^", 0.39265);
-    testPattern(buffer, bufSize, "^%#012.6e^", -0.39265);
-//    testPattern(buffer, bufSize, "^%#012.6e^", 0.0);
+static double benchMedian(const struct benchResult *r) {
+    double sorted[BENCH_MAX_RUNS];
 
-    //Floating point inf/nan/-inf/-nan/-0 tests
-    float inf = 1.0/0.0;
-    float nan = inf/inf;
-    testPattern(buffer, bufSize, "^%f^", inf);
-    testPattern(buffer, bufSize, "^%f^", -inf);
-    testPattern(buffer, bufSize, "^%f^", nan);
-    testPattern(buffer, bufSize, "^%f^", -nan);
-    testPattern(buffer, bufSize, "^%F^", inf);
-    testPattern(buffer, bufSize, "^%F^", -inf);
-    testPattern(buffer, bufSize, "^%F^", nan);
-    testPattern(buffer, bufSize, "^%F^", -nan);
+    memcpy(sorted, r->samples, sizeof (double) * r->numSamples);
+    qsort(sorted, r->numSamples, sizeof (double), benchCompareDoubles);
+    return r->numSamples % 2 ? sorted[r->numSamples / 2]
+        : (sorted[r->numSamples / 2 - 1] + sorted[r->numSamples / 2]) / 2;
+}
 
-    //0-precision integer corner cases:
-    testPattern(buffer, bufSize, "^%.0d^", 0);
-    testPattern(buffer, bufSize, "^%.0i^", 0);
-    testPattern(buffer, bufSize, "^%.0u^", 0);
-    testPattern(buffer, bufSize, "^%.0o^", 0);
-    testPattern(buffer, bufSize, "^%.0x^", 0);
-    testPattern(buffer, bufSize, "^%.0X^", 0);
+//One-sided Mann-Whitney U test: the p-value for current being slower than baseline, from the normal approximation
+//with ties given their average rank.
+static double benchMannWhitney(const struct benchResult *baseline, const struct benchResult *current) {
+    unsigned int n1 = baseline->numSamples, n2 = current->numSamples;
+    double u = 0, mean, sd;
 
-    //G/g... shortest representation of the float value.
-    testPattern(buffer, bufSize, "^%g^", 3.9265);
-    testPattern(buffer, bufSize, "^%g^", 2.0);
-    testPattern(buffer, bufSize, "^%g^", 0.000000000001);
-    testPattern(buffer, bufSize, "^%G^", 3.9265);
-    testPattern(buffer, bufSize, "^%G^", 2.0);
-    testPattern(buffer, bufSize, "^%G^", 0.000000000001);
-    testPattern(buffer, bufSize, "^%#g^", 3.9265);
-    testPattern(buffer, bufSize, "^%#g^", 2.0);
-    testPattern(buffer, bufSize, "^%#g^", 0.000000000001);
-    testPattern(buffer, bufSize, "^%#G^", 3.9265);
-    testPattern(buffer, bufSize, "^%#G^", 2.0);
-    testPattern(buffer, bufSize, "^%#G^", 0.000000000001);
+    for (unsigned int i = 0; i < n2; i++) {
+        for (unsigned int j = 0; j < n1; j++) {
+            u += current->samples[i] > baseline->samples[j] ? 1 : current->samples[i] == baseline->samples[j] ? 0.5 : 0;
+        }
+    }
+    mean = n1 * n2 / 2.0;
+    sd = sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0);
+    //Continuity correction.
+    return sd > 0 ? 0.5 * erfc((u - 0.5 - mean) / sd / sqrt(2.0)) : 1.0;
+}
 
-    //integer vector
-    int4 intV4 = {1, 2, 3, 4};
-    double4 d4 = {1.0, 2.0, 3.0, 4.0};
-    testPatternWithExpected(buffer, bufSize, "^1,2,3,4^", "^%v4i^", intV4);
-    testPatternWithExpected(buffer, bufSize, "1.00,2.00,3.00,4.00^", "%2.2v4hlf", d4);
+//Prints one row per benchmark and returns the number of regressions: at least threshold percent slower by median,
+//with p < 0.05.
+static unsigned int benchCompare(const struct benchResults *baseline, const struct benchResults *current, double threshold) {
+    unsigned int regressions = 0;
 
-    //Floating point hex
-    //testPattern(buffer, bufSize, "^%a^", 392.65);
-    //testPattern(buffer, bufSize, "^%#a^", 392.65);
-    //testPattern(buffer, bufSize, "^%#.0a^", 392.0);
-    //testPattern(buffer, bufSize, "^% #012.6a^", 392.0);
-    //testPattern(buffer, bufSize, "^%a^", 3.9265);
-    //testPattern(buffer, bufSize, "^%#.0a^", 1.0);
-    //testPattern(buffer, bufSize, "^%A^", 392.65);
-    //testPattern(buffer, bufSize, "^%#A^", 392.65);
-    //testPattern(buffer, bufSize, "^%#.0A^", 392.0);
-    //testPattern(buffer, bufSize, "^% #012.6A^", 392.0);
-    //testPattern(buffer, bufSize, "^%A^", 3.9265);
-    //testPattern(buffer, bufSize, "^%#.0A^", 1.0);
+    printf("%-44s %12s %12s %8s %8s  %s\n", "benchmark", "baseline ns", "current ns", "change", "p", "verdict");
+    for (unsigned int i = 0; i < current->numResults; i++) {
+        const struct benchResult *r = &current->results[i];
+        const struct benchResult *b = NULL;
+        double now = benchMedian(r), before, change, p;
+        const char *verdict;
+
+        for (unsigned int j = 0; j < baseline->numResults && !b; j++) {
+            b = strcmp(baseline->results[j].name, r->name) ? NULL : &baseline->results[j];
+        }
+        if (!b || !b->numSamples) {
+            printf("%-44s %12s %12.1f %8s %8s  new\n", r->name, "-", now, "-", "-");
+            continue;
+        }
+        before = benchMedian(b);
+        change = before > 0 ? (now - before) / before * 100 : 0;
+        p = benchMannWhitney(b, r);
+        if (change >= threshold && p < 0.05) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (change <= -threshold && 1 - p < 0.05) {
+            verdict = "faster";
+        } else {
+            verdict = "ok";
+        }
+        printf("%-44s %12.1f %12.1f %+7.1f%% %8.3f  %s\n", r->name, before, now, change, p, verdict);
+    }
+    return regressions;
+}
+
+//printf_bench                         runs the benchmarks once and prints the results.
+//printf_bench --save BASELINE         runs them PRINTF_BENCH_RUNS times (default 5) after a warm-up run and
+//                                     saves the samples as a JSON baseline.
+//printf_bench --compare BASELINE      runs them the same way and compares against the baseline, exiting with 1
+//                                     if anything regressed by PRINTF_BENCH_THRESHOLD percent (default 5).
+int main(int argc, char** argv) {
+    const char *runsEnv = getenv("PRINTF_BENCH_RUNS");
+    const char *thresholdEnv = getenv("PRINTF_BENCH_THRESHOLD");
+    unsigned int runs = runsEnv ? strtoul(runsEnv, NULL, 10) : 5;
+    double threshold = thresholdEnv ? strtod(thresholdEnv, NULL) : 5.0;
+    struct benchResults *current, *baseline;
+    int save = argc == 3 && !strcmp(argv[1], "--save");
+    int stdoutCopy;
+    unsigned int regressions;
+
+    if (argc == 1) {
+        benchSuite();
+        return 0;
+    }
+    if (argc == 2 && !strcmp(argv[1], "--decode")) {
+        benchParallelDecode();
+        return 0;
+    }
+    if (argc != 3 || (!save && strcmp(argv[1], "--compare"))) {
+        fprintf(stderr, "usage: %s [--save BASELINE | --compare BASELINE | --decode]\n", argv[0]);
+        return 2;
+    }
+    runs = runs < 1 ? 1 : runs > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : runs;
+    current = calloc(1, sizeof (*current));
+    baseline = calloc(1, sizeof (*baseline));
+    if (!current || !baseline) {
+        return 2;
+    }
+    if (!save && benchLoadBaseline(baseline, argv[2]) < 0) {
+        fprintf(stderr, "no baseline at %s, make one with %s --save %s\n", argv[2], argv[0], argv[2]);
+        return 2;
+    }
 
+    //The suite's own output goes nowhere while we collect. The first run only warms caches, page tables and
+    //the CPU's clocks.
+    fflush(stdout);
+    stdoutCopy = dup(1);
+    if (!freopen("/dev/null", "w", stdout)) {
+        return 2;
+    }
+    benchSuite();
+    benchCollecting = current;
+    for (unsigned int run = 0; run < runs; run++) {
+        benchSuite();
+    }
+    benchCollecting = NULL;
+    fflush(stdout);
+    dup2(stdoutCopy, 1);
+    close(stdoutCopy);
+
+    if (save) {
+        if (benchSaveBaseline(current, argv[2]) < 0) {
+            fprintf(stderr, "can't write %s\n", argv[2]);
+            return 2;
+        }
+        printf("saved %u benchmarks x %u runs to %s\n", current->numResults, runs, argv[2]);
+        return 0;
+    }
+    regressions = benchCompare(baseline, current, threshold);
+    printf("%u regressions over %.1f%% in %u benchmarks x %u runs\n", regressions, threshold, current->numResults, runs);
+    return regressions != 0;
+}
+#endif
+
+#ifdef PRINTF_MERGE_TOOL
+//printf_merge OUTPUT INPUT...  merges the captures of several processes into one, ordered by timestamp.
+//printf_merge -d CAPTURE       prints a capture as text, each line prefixed with its rank.
+//printf_merge -p CAPTURE [THREADS]  does the same with the NUMA-aware parallel decoder.
+int main(int argc, char** argv) {
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-p")) {
+        struct parallelDecoder *d = malloc(sizeof (*d));
+        FILE *file = fopen(argv[2], "rb");
+        size_t size;
+        char *capture = file ? parallelDecoderLoad(file, &size) : NULL;
+        int ret;
+
+        if (!d || !capture || parallelDecoderOpen(d, capture, size) < 0) {
+            fprintf(stderr, "%s: not a capture\n", argv[2]);
+            return 1;
+        }
+        d->prefixRank = 1;
+        ret = parallelDecode(d, argc == 4 ? strtoul(argv[3], NULL, 10) : 0, 1);
+        if (ret == 0) {
+            ret = parallelDecoderWrite(d, stdout);
+        }
+        parallelDecoderClose(d);
+        fclose(file);
+        free(capture);
+        free(d);
+        if (ret < 0) {
+            fprintf(stderr, "%s: malformed capture\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 3 && !strcmp(argv[1], "-d")) {
+        struct captureReader *r = malloc(sizeof (*r));
+        FILE *file = fopen(argv[2], "rb");
+        size_t lineSize = 4096;
+        char *line = malloc(lineSize);
+        int ret;
+
+        if (!r || !file || !line || captureReaderOpen(r, file) < 0) {
+            fprintf(stderr, "%s: not a capture\n", argv[2]);
+            return 1;
+        }
+        while ((ret = captureNext(r)) > 0) {
+            int length = captureDecode(r, line, lineSize);
+            if (length >= 0 && (size_t) length >= lineSize) {
+                //Too long for the line buffer, so decode it again into one that fits.
+                char *grown = realloc(line, length + 1);
+                if (!grown) {
+                    ret = -1;
+                    break;
+                }
+                line = grown;
+                lineSize = length + 1;
+                length = captureDecode(r, line, lineSize);
+            }
+            if (length < 0) {
+                ret = -1;
+                break;
+            }
+            printf("[%u] ", r->entry.rank);
+            fwrite(line, 1, length, stdout);
+        }
+        captureReaderClose(r);
+        fclose(file);
+        free(line);
+        free(r);
+        if (ret < 0) {
+            fprintf(stderr, "%s: malformed capture\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (argc >= 3) {
+        unsigned int numInputs = argc - 2;
+        FILE **inputs = calloc(numInputs, sizeof (*inputs));
+        FILE *output = fopen(argv[1], "wb");
+        long merged;
+
+        if (!inputs || !output) {
+            fprintf(stderr, "can't create %s\n", argv[1]);
+            return 1;
+        }
+        for (unsigned int i = 0; i < numInputs; i++) {
+            if (!(inputs[i] = fopen(argv[i + 2], "rb"))) {
+                fprintf(stderr, "can't open %s\n", argv[i + 2]);
+                return 1;
+            }
+            //Large stream buffers keep the k-way merge from seeking between inputs on every record.
+            setvbuf(inputs[i], NULL, _IOFBF, 1 << 20);
+        }
+        setvbuf(output, NULL, _IOFBF, 1 << 20);
+
+        merged = captureMerge(inputs, numInputs, output);
+        for (unsigned int i = 0; i < numInputs; i++) {
+            fclose(inputs[i]);
+        }
+        if (fclose(output) != 0 || merged < 0) {
+            fprintf(stderr, "merge failed\n");
+            return 1;
+        }
+        printf("merged %ld records from %u captures\n", merged, numInputs);
+        return 0;
+    }
+
+    fprintf(stderr, "usage: %s OUTPUT INPUT...\n       %s -d CAPTURE\n       %s -p CAPTURE [THREADS]\n", argv[0],
+            argv[0], argv[0]);
+    return 2;
+}
+#endif
+
+#ifdef PRINTF_FUZZER
+//Builds a case straight from fuzzer bytes, for libFuzzer's own mutator.
+static void fuzzDecode(const uint8_t *data, size_t size, struct fuzzCase *c) {
+    uint8_t bytes[32] = {0};
+
+    memcpy(bytes, data, size < sizeof (bytes) ? size : sizeof (bytes));
+    memset(c, 0, sizeof (*c));
+    c->flags = bytes[0] & 31;
+    c->width = (int) (((unsigned) bytes[1] << 8 | bytes[2]) % 5000) - 1;
+    c->precision = (int) (((unsigned) bytes[3] << 8 | bytes[4]) % 600) - 1;
+    c->length = bytes[5] % 4;
+    c->spec = FUZZ_SPECIFIERS[bytes[6] % FUZZ_NUM_SPECIFIERS];
+    memcpy(&c->i, bytes + 8, sizeof (c->i));
+    memcpy(&c->d, bytes + 16, sizeof (c->d));
+    c->stringLength = ((unsigned) bytes[24] << 8 | bytes[25]) % sizeof (fuzzString);
+    fuzzRender(c);
+}
+
+static struct fuzzCorpus fuzzCorpus;
+
+static const char* fuzzCorpusPath() {
+    const char *path = getenv("PRINTF_FUZZ_CORPUS");
+    return path ? path : FUZZ_DEFAULT_CORPUS;
+}
+
+#ifdef PRINTF_LIBFUZZER
+static void fuzzSaveAtExit() {
+    fuzzCorpusSave(&fuzzCorpus, fuzzCorpusPath());
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int initialized = 0;
+    struct fuzzCase c;
+
+    if (!initialized) {
+        fuzzCorpusLoad(&fuzzCorpus, fuzzCorpusPath());
+        atexit(fuzzSaveAtExit);
+        initialized = 1;
+    }
+    fuzzDecode(data, size, &c);
+    c.cost = fuzzCost(&c);
+    if (c.cost >= 0) {
+        fuzzCorpusAdd(&fuzzCorpus, &c);
+    }
+    return 0;
+}
+#else
+//printf_fuzz [ITERATIONS]  mutates the corpus in PRINTF_FUZZ_CORPUS (default printf_fuzz.corpus) looking for the
+//slowest case per specifier, and writes it back.
+int main(int argc, char** argv) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    const char *path = fuzzCorpusPath();
+    int loaded = fuzzCorpusLoad(&fuzzCorpus, path);
+    unsigned long kept = 0;
+
+    fuzzRandomState ^= cheapTimestamp();
+    for (unsigned long n = 0; n < iterations; n++) {
+        unsigned int s = fuzzRandom() % FUZZ_NUM_SPECIFIERS;
+        struct fuzzCase c;
+
+        if (fuzzCorpus.counts[s] && fuzzRandom() % 4) {
+            c = fuzzCorpus.cases[s][fuzzRandom() % fuzzCorpus.counts[s]];
+        } else {
+            memset(&c, 0, sizeof (c));
+            c.width = -1;
+            c.precision = -1;
+            c.spec = FUZZ_SPECIFIERS[s];
+        }
+        for (unsigned int m = 1 + fuzzRandom() % 3; m > 0; m--) {
+            fuzzMutate(&c);
+        }
+        c.cost = fuzzCost(&c);
+        if (c.cost >= 0) {
+            kept += fuzzCorpusAdd(&fuzzCorpus, &c);
+        }
+    }
+
+    for (unsigned int s = 0; s < FUZZ_NUM_SPECIFIERS; s++) {
+        if (fuzzCorpus.counts[s]) {
+            printf("%c: slowest %-24s %10.2f ns/byte\n", FUZZ_SPECIFIERS[s], fuzzCorpus.cases[s][0].fmt,
+                   fuzzCorpus.cases[s][0].cost);
+        }
+    }
+    printf("%lu iterations from %d cases, %lu new slowest cases\n", iterations, loaded > 0 ? loaded : 0, kept);
+    if (fuzzCorpusSave(&fuzzCorpus, path) < 0) {
+        fprintf(stderr, "%s: can't write corpus\n", path);
+        return 1;
+    }
+    return 0;
+}
+#endif
+#endif
+
+#ifdef PRINTF_DIFFERENTIAL
+#include <pthread.h>
+#include <unistd.h>
+
+//Randomized differential testing: random single conversions go through myPrintf and each of the faster paths,
+//and every result is compared with vsnprintf. Mismatches are shrunk to a short reproducer before being reported.
+typedef enum DIFF_PATH {
+    DIFF_MYPRINTF,
+    DIFF_COMPILED,
+    DIFF_TEMPLATE,
+    DIFF_ADAPTIVE,
+    DIFF_JIT,
+    DIFF_NUM_PATHS
+} diffPath;
+
+static const char* diffPathNames[DIFF_NUM_PATHS] = {"myPrintf", "printCompiled", "printTemplate", "printAdaptive", "printJit"};
+
+#define DIFF_OUTPUT_SIZE 8192
+#define DIFF_MAX_REPRODUCERS 64
+//Characters of output shown before the first difference in a report.
+#define DIFF_REPORT_CONTEXT 20
+
+struct diffScratch {
+    struct compiledFormat cf;
+    struct printTemplate tmpl;
+    struct adaptiveFormat af;
+    struct jitFormat jf;
+    char expected[DIFF_OUTPUT_SIZE];
+    char output[DIFF_OUTPUT_SIZE];
+    char reference[DIFF_OUTPUT_SIZE];
+};
+
+struct diffRun {
+    atomic_ulong nextCase;
+    unsigned long numCases;
+    uint64_t seed;
+    atomic_ulong checked[DIFF_NUM_PATHS];
+    atomic_ulong mismatches[DIFF_NUM_PATHS];
+    atomic_ulong divergences[DIFF_NUM_PATHS];
+    pthread_mutex_t lock;
+    unsigned int numReproducers;
+    char reproducers[DIFF_MAX_REPRODUCERS][64];
+};
+
+static int diffSystem(char* output, size_t out_size, const char* fmt, ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(output, out_size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+//Formats c through one path into s->output. Returns 0 if the path doesn't apply to c, 1 if it produced output.
+static int diffRunPath(const struct fuzzCase *c, diffPath path, struct diffScratch *s) {
+    int ret = -1;
+
+    switch (path) {
+        case DIFF_MYPRINTF:
+            ret = fuzzRun(c, s->output, DIFF_OUTPUT_SIZE);
+            break;
+        case DIFF_COMPILED:
+            if (compileFormat(&s->cf, c->fmt) < 0) return 0;
+            FUZZ_CALL(ret, c, printCompiled, &s->cf, s->output, DIFF_OUTPUT_SIZE);
+            break;
+        case DIFF_TEMPLATE:
+            if (compileTemplate(&s->tmpl, c->fmt) < 0) return 0;
+            FUZZ_CALL(ret, c, printTemplate, &s->tmpl, s->output, DIFF_OUTPUT_SIZE);
+            break;
+        case DIFF_ADAPTIVE:
+            //Run it past the warm-up so that the specialized emitters get their turn.
+            if (compileAdaptive(&s->af, c->fmt) < 0) return 0;
+            for (unsigned int i = 0; i <= ADAPTIVE_WARMUP_CALLS; i++) {
+                FUZZ_CALL(ret, c, printAdaptive, &s->af, s->output, DIFF_OUTPUT_SIZE);
+            }
+            break;
+        case DIFF_JIT:
+            if (jitCompile(&s->jf, c->fmt) < 0) return 0;
+            FUZZ_CALL(ret, c, printJit, &s->jf, s->output, DIFF_OUTPUT_SIZE);
+            jitFree(&s->jf);
+            break;
+        default:
+            return 0;
+    }
+    if (ret < 0) {
+        strcpy(s->output, "(error)");
+    }
+    return 1;
+}
+
+//Returns 1 if c comes out differently through path than through vsnprintf, 0 if it's the same and -1 if the path
+//doesn't handle c.
+static int diffMismatch(const struct fuzzCase *c, diffPath path, struct diffScratch *s) {
+    int ret;
+
+    FUZZ_CALL(ret, c, diffSystem, s->expected, DIFF_OUTPUT_SIZE, c->fmt);
+    if (ret < 0) {
+        strcpy(s->expected, "(error)");
+    }
+    if (!diffRunPath(c, path, s)) {
+        return -1;
+    }
+    return strcmp(s->expected, s->output) != 0;
+}
+
+//Returns 1 if the output left in s->output is what myPrintf makes of c too, in which case a faster path is only
+//repeating an engine bug rather than adding its own.
+static int diffSameAsMyPrintf(const struct fuzzCase *c, struct diffScratch *s) {
+    int same;
+
+    memcpy(s->reference, s->output, DIFF_OUTPUT_SIZE);
+    diffRunPath(c, DIFF_MYPRINTF, s);
+    same = !strcmp(s->reference, s->output);
+    memcpy(s->output, s->reference, DIFF_OUTPUT_SIZE);
+    return same;
+}
+
+//Shrinks a mismatching case one simplification at a time for as long as it keeps mismatching: dropping flags,
+//width, precision and length, then making the argument smaller.
+static void diffMinimize(struct fuzzCase *c, diffPath path, struct diffScratch *s) {
+    int progress = 1;
+
+    while (progress) {
+        struct fuzzCase tries[12];
+        unsigned int numTries = 0;
+
+        progress = 0;
+        for (unsigned int f = 0; f < 5; f++) {
+            if (c->flags & (1u << f)) {
+                tries[numTries] = *c;
+                tries[numTries++].flags &= ~(1u << f);
+            }
+        }
+        if (c->width >= 0) {
+            tries[numTries] = *c;
+            tries[numTries++].width = c->width > 1 ? c->width / 2 : -1;
+        }
+        if (c->precision >= 0) {
+            tries[numTries] = *c;
+            tries[numTries++].precision = c->precision > 1 ? c->precision / 2 : -1;
+        }
+        if (c->length) {
+            tries[numTries] = *c;
+            tries[numTries++].length = 0;
+        }
+        if (c->i != 0) {
+            tries[numTries] = *c;
+            tries[numTries++].i = c->i / 2;
+        }
+        if (c->d != 0.0 && isfinite(c->d)) {
+            tries[numTries] = *c;
+            tries[numTries++].d = fabs(c->d) > 1.0 ? trunc(c->d / 16) : 0.0;
+        }
+        if (c->stringLength) {
+            tries[numTries] = *c;
+            tries[numTries++].stringLength = c->stringLength / 2;
+        }
+
+        for (unsigned int i = 0; i < numTries && !progress; i++) {
+            fuzzRender(&tries[i]);
+            if (diffMismatch(&tries[i], path, s) > 0) {
+                *c = tries[i];
+                progress = 1;
+            }
+        }
+    }
+    //Leave the scratch holding this case's outputs for the report.
+    diffMismatch(c, path, s);
+}
+
+//Reports a minimized mismatch, once per distinct path and format.
+static void diffReport(struct diffRun *run, const struct fuzzCase *c, diffPath path, struct diffScratch *s) {
+    char key[64];
+
+    snprintf(key, sizeof (key), "%s %s", diffPathNames[path], c->fmt);
+    pthread_mutex_lock(&run->lock);
+    for (unsigned int i = 0; i < run->numReproducers; i++) {
+        if (!strcmp(run->reproducers[i], key)) {
+            pthread_mutex_unlock(&run->lock);
+            return;
+        }
+    }
+    if (run->numReproducers < DIFF_MAX_REPRODUCERS) {
+        //Show the outputs from a little before where they first differ, since long ones often share a prefix.
+        size_t at = 0, from;
+        while (s->expected[at] && s->expected[at] == s->output[at]) {
+            at++;
+        }
+        from = at > DIFF_REPORT_CONTEXT ? at - DIFF_REPORT_CONTEXT : 0;
+        strcpy(run->reproducers[run->numReproducers++], key);
+        printf("%-13s %-12s i=%ld d=%a s=%u: differs at %zu: expected %s\"%.60s\" got %s\"%.60s\"\n", diffPathNames[path],
+               c->fmt, c->i, c->d, c->stringLength, at, from ? "..." : "", s->expected + from, from ? "..." : "",
+               s->output + from);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void* diffWorker(void *arg) {
+    struct diffRun *run = arg;
+    struct diffScratch *s = malloc(sizeof (*s));
+    unsigned long n;
+
+    if (!s) {
+        return NULL;
+    }
+    while ((n = atomic_fetch_add_explicit(&run->nextCase, 1, memory_order_relaxed)) < run->numCases) {
+        struct fuzzCase c;
+
+        //Each case gets its own seed, so a run is reproducible whatever the thread count.
+        fuzzRandomState = run->seed ^ (n + 1) * 0x9e3779b97f4a7c15u;
+        memset(&c, 0, sizeof (c));
+        c.width = -1;
+        c.precision = -1;
+        c.spec = FUZZ_SPECIFIERS[fuzzRandom() % FUZZ_NUM_SPECIFIERS];
+        for (unsigned int m = 1 + fuzzRandom() % 6; m > 0; m--) {
+            fuzzMutate(&c);
+        }
+        for (diffPath path = 0; path < DIFF_NUM_PATHS; path++) {
+            int mismatch = diffMismatch(&c, path, s);
+            struct fuzzCase shrunk = c;
+
+            if (mismatch < 0) {
+                continue;
+            }
+            atomic_fetch_add_explicit(&run->checked[path], 1, memory_order_relaxed);
+            if (!mismatch) {
+                continue;
+            }
+            atomic_fetch_add_explicit(&run->mismatches[path], 1, memory_order_relaxed);
+            if (path != DIFF_MYPRINTF && diffSameAsMyPrintf(&c, s)) {
+                //Already reported against myPrintf.
+                continue;
+            }
+            if (path != DIFF_MYPRINTF) {
+                atomic_fetch_add_explicit(&run->divergences[path], 1, memory_order_relaxed);
+            }
+            diffMinimize(&shrunk, path, s);
+            diffReport(run, &shrunk, path, s);
+        }
+    }
+    free(s);
+    return NULL;
+}
+
+//printf_diff [CASES [SEED]]  checks CASES random conversions (default 100000) on every core. Mismatches against
+//vsnprintf are reported, but only a fast path that disagrees with myPrintf makes it exit nonzero, so that it gates
+//the fast paths without failing on the engine's known differences from the C library.
+int main(int argc, char** argv) {
+    static struct diffRun run;
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    unsigned long mismatches = 0, divergences = 0;
+
+    run.numCases = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    run.seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+    numThreads = numThreads > 0 ? numThreads : 1;
+    threads = malloc(sizeof (pthread_t) * numThreads);
+    pthread_mutex_init(&run.lock, NULL);
+
+    for (long t = 0; t < numThreads; t++) {
+        pthread_create(&threads[t], NULL, diffWorker, &run);
+    }
+    for (long t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (diffPath path = 0; path < DIFF_NUM_PATHS; path++) {
+        printf("%-13s %10lu checked %10lu mismatches %10lu not matching myPrintf\n", diffPathNames[path],
+               atomic_load(&run.checked[path]), atomic_load(&run.mismatches[path]), atomic_load(&run.divergences[path]));
+        mismatches += atomic_load(&run.mismatches[path]);
+        divergences += atomic_load(&run.divergences[path]);
+    }
+    printf("%lu cases with seed %llu on %ld threads\n", run.numCases, (unsigned long long) run.seed, numThreads);
+    printf("%lu mismatches against vsnprintf, %lu fast path results not matching myPrintf\n", mismatches, divergences);
+    free(threads);
+    return divergences != 0;
 }
+#endif